@@ -0,0 +1,405 @@
+/*
+ * Microbenchmarks of queue operations.  queue.c is linked on its own, with
+ * the system malloc (or whatever allocator is linked in) instead of the test
+ * harness, and each operation is timed over whole queues of several sizes
+ * and string lengths.  Results are written as CSV.
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#define MAX_SIZES 16
+#define MAX_LENS 16
+
+/* Calls of q_delete_mid timed per run, each walking half the queue */
+#define DM_CALLS 64
+
+static size_t sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+static int size_cnt = 4;
+static size_t lens[MAX_LENS] = {8, 64};
+static int len_cnt = 2;
+static int reps = 5;
+static int warmup = 1;
+static char *only = NULL;
+
+/* Strings to insert: random, and sorted with each one twice (for dedup) */
+static char **rand_strs = NULL;
+static char **dup_strs = NULL;
+static char *remove_buf = NULL;
+static size_t str_len = 0;
+
+typedef struct {
+    const char *name;
+    /* Untimed: fill q for a run with n elements */
+    bool (*setup)(struct list_head *q, size_t n);
+    /* Timed: return the number of operations done */
+    size_t (*run)(struct list_head *q, size_t n);
+} bench_t;
+
+static uint64_t xs_state = 0x9e3779b97f4a7c15;
+
+static uint64_t xs_next()
+{
+    xs_state ^= xs_state >> 12;
+    xs_state ^= xs_state << 25;
+    xs_state ^= xs_state >> 27;
+    return xs_state * 0x2545f4914f6cdd1d;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void free_strings(char **strs, size_t n)
+{
+    if (!strs)
+        return;
+    for (size_t i = 0; i < n; i++)
+        free(strs[i]);
+    free(strs);
+}
+
+/* Make the strings of a size and length.  Return true if successful */
+static bool make_strings(size_t n, size_t len)
+{
+    rand_strs = calloc(n, sizeof(char *));
+    dup_strs = calloc(n, sizeof(char *));
+    remove_buf = malloc(len + 1);
+    if (!rand_strs || !dup_strs || !remove_buf)
+        return false;
+
+    for (size_t i = 0; i < n; i++) {
+        rand_strs[i] = malloc(len + 1);
+        dup_strs[i] = malloc(len + 1);
+        if (!rand_strs[i] || !dup_strs[i])
+            return false;
+        for (size_t j = 0; j < len; j++)
+            rand_strs[i][j] = 'a' + xs_next() % 26;
+        rand_strs[i][len] = '\0';
+        /* Fixed-width base 26 keys, each used twice */
+        size_t k = i / 2;
+        for (size_t j = len; j-- > 0; k /= 26)
+            dup_strs[i][j] = 'a' + k % 26;
+        dup_strs[i][len] = '\0';
+    }
+    str_len = len;
+    return true;
+}
+
+static void drop_strings(size_t n)
+{
+    free_strings(rand_strs, n);
+    free_strings(dup_strs, n);
+    free(remove_buf);
+    rand_strs = dup_strs = NULL;
+    remove_buf = NULL;
+}
+
+static bool setup_empty(struct list_head *q, size_t n)
+{
+    return true;
+}
+
+static bool setup_fill(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!q_insert_tail(q, rand_strs[i]))
+            return false;
+    }
+    return q_size(q) == n;
+}
+
+static bool setup_dups(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!q_insert_tail(q, dup_strs[i]))
+            return false;
+    }
+    return q_size(q) == n;
+}
+
+static size_t run_ih(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        q_insert_head(q, rand_strs[i]);
+    return n;
+}
+
+static size_t run_it(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        q_insert_tail(q, rand_strs[i]);
+    return n;
+}
+
+static size_t run_rh(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        q_release_element(q_remove_head(q, remove_buf, str_len + 1));
+    return n;
+}
+
+static size_t run_rt(struct list_head *q, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        q_release_element(q_remove_tail(q, remove_buf, str_len + 1));
+    return n;
+}
+
+static size_t run_reverse(struct list_head *q, size_t n)
+{
+    q_reverse(q);
+    return n;
+}
+
+static size_t run_swap(struct list_head *q, size_t n)
+{
+    q_swap(q);
+    return n;
+}
+
+static size_t run_dedup(struct list_head *q, size_t n)
+{
+    q_delete_dup(q);
+    return n;
+}
+
+static size_t run_dm(struct list_head *q, size_t n)
+{
+    size_t calls = n < DM_CALLS ? n : DM_CALLS;
+    for (size_t i = 0; i < calls; i++)
+        q_delete_mid(q);
+    return calls;
+}
+
+static size_t run_sort(struct list_head *q, size_t n)
+{
+    q_sort(q);
+    return n;
+}
+
+static const bench_t benches[] = {
+    {"insert_head", setup_empty, run_ih},
+    {"insert_tail", setup_empty, run_it},
+    {"remove_head", setup_fill, run_rh},
+    {"remove_tail", setup_fill, run_rt},
+    {"reverse", setup_fill, run_reverse},
+    {"swap", setup_fill, run_swap},
+    {"dedup", setup_dups, run_dedup},
+    {"delete_mid", setup_fill, run_dm},
+    {"sort", setup_fill, run_sort},
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Is name picked by the comma separated list in only? */
+static bool selected(const char *name)
+{
+    if (!only)
+        return true;
+    size_t len = strlen(name);
+    for (const char *p = only; p;) {
+        const char *end = strchr(p, ',');
+        size_t plen = end ? (size_t) (end - p) : strlen(p);
+        if (plen == len && !strncmp(p, name, len))
+            return true;
+        p = end ? end + 1 : NULL;
+    }
+    return false;
+}
+
+/*
+ * Time one run of b on n elements.  Return the nanoseconds taken, or a
+ * negative value if queue.c failed to set up the queue.
+ */
+static double run_once(const bench_t *b, size_t n, size_t *ops)
+{
+    struct list_head *q = q_new();
+    if (!q || !b->setup(q, n)) {
+        q_free(q);
+        return -1;
+    }
+
+    double start = now_ns();
+    *ops = b->run(q, n);
+    double elapsed = now_ns() - start;
+
+    q_free(q);
+    return elapsed;
+}
+
+/* Run b reps times after warming up, and write its CSV line */
+static bool run_bench(FILE *out, const bench_t *b, size_t n, size_t len)
+{
+    double times[reps];
+    size_t ops = 0;
+
+    for (int i = 0; i < warmup + reps; i++) {
+        double t = run_once(b, n, &ops);
+        if (t < 0) {
+            fprintf(stderr,
+                    "%s: queue.c could not build a queue of %lu elements\n",
+                    b->name, n);
+            return false;
+        }
+        if (i >= warmup)
+            times[i - warmup] = t;
+    }
+
+    double sum = 0, sq = 0;
+    for (int i = 0; i < reps; i++)
+        sum += times[i];
+    double mean = sum / reps;
+    for (int i = 0; i < reps; i++)
+        sq += (times[i] - mean) * (times[i] - mean);
+    double sd = reps > 1 ? sqrt(sq / (reps - 1)) : 0;
+    qsort(times, reps, sizeof(double), cmp_double);
+    double median = reps % 2 ? times[reps / 2]
+                             : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+
+    fprintf(out, "%s,%lu,%lu,%d,%lu,%.0f,%.0f,%.0f,%.0f,%.3f\n", b->name, n,
+            len, reps, ops, mean, median, times[0], sd,
+            ops ? median / ops : 0);
+    fflush(out);
+    return true;
+}
+
+/* Parse a comma separated list of counts into list.  Return its length */
+static int parse_list(char *arg, size_t *list, int max)
+{
+    int cnt = 0;
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        double v = strtod(tok, &end);
+        if (end == tok || *end || v < 1 || v != floor(v) || cnt == max)
+            return 0;
+        list[cnt++] = (size_t) v;
+    }
+    return cnt;
+}
+
+static void usage(char *cmd)
+{
+    printf(
+        "Usage: %s [-h] [-n SIZES] [-l LENS] [-r REPS] [-w WARMUP] "
+        "[-c CPU] [-b NAMES] [-o FILE]\n",
+        cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-n SIZES   Queue sizes, e.g. 1e3,1e6 (default 1e3 to 1e6)\n");
+    printf("\t-l LENS    String lengths (default 8,64)\n");
+    printf("\t-r REPS    Timed runs of each benchmark (default 5)\n");
+    printf("\t-w WARMUP  Untimed runs before those (default 1)\n");
+    printf("\t-c CPU     Run pinned to CPU\n");
+    printf("\t-b NAMES   Run only these benchmarks, among:\n\t\t  ");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        printf(" %s", benches[i].name);
+    printf("\n\t-o FILE    Write CSV to FILE instead of standard output\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    char *out_name = NULL;
+    int cpu = -1;
+    int c;
+
+    while ((c = getopt(argc, argv, "hn:l:r:w:c:b:o:")) != -1) {
+        switch (c) {
+        case 'n':
+            size_cnt = parse_list(optarg, sizes, MAX_SIZES);
+            if (!size_cnt) {
+                fprintf(stderr, "Invalid sizes '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            len_cnt = parse_list(optarg, lens, MAX_LENS);
+            if (!len_cnt) {
+                fprintf(stderr, "Invalid lengths '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'b':
+            only = optarg;
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (reps < 1 || warmup < 0) {
+        fprintf(stderr, "Need at least one timed run\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            fprintf(stderr, "Couldn't pin to CPU %d: %s\n", cpu,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *out = out_name ? fopen(out_name, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Couldn't open '%s'\n", out_name);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out,
+            "benchmark,size,length,repetitions,ops,mean_ns,median_ns,min_ns,"
+            "stddev_ns,ns_per_op\n");
+
+    bool ok = true;
+    for (int s = 0; ok && s < size_cnt; s++) {
+        for (int l = 0; ok && l < len_cnt; l++) {
+            if (!make_strings(sizes[s], lens[l])) {
+                fprintf(stderr, "Couldn't allocate %lu strings\n", sizes[s]);
+                ok = false;
+            }
+            for (size_t i = 0;
+                 ok && i < sizeof(benches) / sizeof(benches[0]); i++) {
+                if (selected(benches[i].name))
+                    ok = run_bench(out, &benches[i], sizes[s], lens[l]);
+            }
+            drop_strings(sizes[s]);
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+    return ok ? 0 : 1;
+}
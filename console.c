@@ -69,6 +69,21 @@ static bool has_infile = false;
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Function invoked before every command, and number of commands so far */
+static cmd_hook_function cmd_hook = NULL;
+static cmd_done_function cmd_done_hook = NULL;
+static size_t cmd_count = 0;
+
+/* Parameter values kept by save_params */
+typedef struct {
+    int *valp;
+    int val;
+    setter_function setter;
+} saved_param_t;
+
+static saved_param_t *saved_params = NULL;
+static size_t saved_param_cnt = 0;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -116,6 +131,37 @@ void add_param(char *name,
     *last_loc = ele;
 }
 
+void save_params()
+{
+    size_t cnt = 0;
+    for (param_ptr p = param_list; p; p = p->next)
+        cnt++;
+
+    if (saved_params)
+        free_array(saved_params, saved_param_cnt, sizeof(saved_param_t));
+    saved_params = cnt ? calloc_or_fail(cnt, sizeof(saved_param_t),
+                                        "save_params")
+                       : NULL;
+    saved_param_cnt = cnt;
+
+    saved_param_t *s = saved_params;
+    for (param_ptr p = param_list; p; p = p->next, s++)
+        *s = (saved_param_t){p->valp, *p->valp, p->setter};
+}
+
+void restore_params()
+{
+    for (size_t i = 0; i < saved_param_cnt; i++) {
+        saved_param_t *s = &saved_params[i];
+        int oldval = *s->valp;
+        if (oldval == s->val)
+            continue;
+        *s->valp = s->val;
+        if (s->setter)
+            s->setter(oldval);
+    }
+}
+
 /* Parse a string into a command line */
 static char **parse_args(char *line, int *argcp)
 {
@@ -181,15 +227,20 @@ static bool interpret_cmda(int argc, char *argv[])
     bool ok = true;
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
+    cmd_count++;
+    if (cmd_hook)
+        cmd_hook(cmd_count, argc, argv);
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
         if (!ok)
             record_error();
     } else {
-        report(1, "Unknown command '%s'", argv[0]);
+        report_error(1, "Unknown command '%s'", argv[0]);
         record_error();
         ok = false;
     }
+    if (cmd_done_hook)
+        cmd_done_hook(cmd_count, argc, argv, ok);
 
     return ok;
 }
@@ -200,9 +251,7 @@ static bool interpret_cmd(char *cmdline)
     if (quit_flag)
         return false;
 
-#if RPT >= 6
     report(6, "Interpreting command '%s'\n", cmdline);
-#endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
     bool ok = interpret_cmda(argc, argv);
@@ -222,22 +271,33 @@ void add_quit_helper(cmd_function qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be invoked before every command */
+void set_cmd_hook(cmd_hook_function hook)
+{
+    cmd_hook = hook;
+}
+
+void set_cmd_done_hook(cmd_done_function hook)
+{
+    cmd_done_hook = hook;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
     echo = on ? 1 : 0;
 }
 
-/* Built-in commands */
-static bool do_quit(int argc, char *argv[])
+/* Free the command and parameter lists, and close any input files */
+static void free_tables()
 {
     cmd_ptr c = cmd_list;
-    bool ok = true;
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
         free_block(ele, sizeof(cmd_ele));
     }
+    cmd_list = NULL;
 
     param_ptr p = param_list;
     while (p) {
@@ -245,15 +305,24 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    param_list = NULL;
 
     while (buf_stack)
         pop_file();
+}
+
+/* Built-in commands */
+static bool do_quit(int argc, char *argv[])
+{
+    bool ok = true;
+    free_tables();
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
     quit_flag = true;
+    report_flush();
     return ok;
 }
 
@@ -397,13 +466,30 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void set_async(int oldval)
+{
+    set_async_log(async_log);
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    mem_report(1);
+    return true;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
-    cmd_list = NULL;
-    param_list = NULL;
+    /* Left behind by an earlier run that stopped without quitting */
+    free_tables();
     err_cnt = 0;
     quit_flag = false;
+    quit_helper_cnt = 0;
+    cmd_count = 0;
 
     ADD_COMMAND(help, "                | Show documentation");
     ADD_COMMAND(option, " [name val]     | Display or set options");
@@ -411,11 +497,17 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(mem, "                | Show memory usage per subsystem");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("mblimit", &mblimit, "Memory limit in megabytes (0 = unlimited)",
+              NULL);
+    add_param("asynclog", &async_log,
+              "Write output from a background thread, in batches",
+              set_async);
 
     init_in();
     init_time(&last_time);
@@ -556,6 +648,7 @@ int cmd_select(int nfds,
         infd = buf_stack->fd;
         FD_SET(infd, readfds);
         if (infd == STDIN_FILENO && prompt_flag) {
+            report_flush();
             printf("%s", prompt);
             fflush(stdout);
             prompt_flag = true;
@@ -639,17 +732,20 @@ void completion(const char *buf, linenoiseCompletions *lc)
 bool run_console(char *infile_name)
 {
     if (!push_file(infile_name)) {
-        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        report_error(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
     }
 
     if (!has_infile) {
         char *cmdline;
+        report_flush();
         while ((cmdline = linenoise(prompt)) != NULL) {
             interpret_cmd(cmdline);
-            linenoiseHistoryAdd(cmdline);       /* Add to the history. */
-            linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+            /* Add to the history, and to the end of its file on disk. */
+            if (linenoiseHistoryAdd(cmdline))
+                linenoiseHistoryAppend(HISTORY_FILE, cmdline);
             linenoiseFree(cmdline);
+            report_flush();
         }
     } else {
         while (!cmd_done())
@@ -1,6 +1,7 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/select.h>
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
@@ -51,9 +52,30 @@ void add_param(char *name,
                char *doccumentation,
                setter_function setter);
 
+/*
+ * Remember the current value of every parameter.  restore_params() sets
+ * them back, calling setters of those that change, so that runs sharing a
+ * process each start from the same options.
+ */
+void save_params();
+void restore_params();
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Optionally supply function invoked before every command.
+ * index counts the commands interpreted so far, starting from 1.
+ */
+typedef void (*cmd_hook_function)(size_t index, int argc, char *argv[]);
+void set_cmd_hook(cmd_hook_function hook);
+
+/* Optionally supply function invoked after every command, with its result */
+typedef void (*cmd_done_function)(size_t index,
+                                  int argc,
+                                  char *argv[],
+                                  bool ok);
+void set_cmd_done_hook(cmd_done_function hook);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
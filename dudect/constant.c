@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "cpucycles.h"
+#include "perfcounter.h"
 #include "queue.h"
 #include "random.h"
 
@@ -63,8 +64,32 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/* Hardware counters are read outside of the cycle measurement, so the
+ * read() calls do not show up in the timing.  The counter arrays hold
+ * N_PERF_EVENTS values per measurement and are NULL when not in use.
+ */
+static inline void measure_start(int64_t *before_ticks,
+                                 int64_t *before_events,
+                                 size_t i)
+{
+    if (before_events)
+        perf_counters_read(before_events + i * N_PERF_EVENTS);
+    before_ticks[i] = cpucycles_start();
+}
+
+static inline void measure_stop(int64_t *after_ticks,
+                                int64_t *after_events,
+                                size_t i)
+{
+    after_ticks[i] = cpucycles_stop();
+    if (after_events)
+        perf_counters_read(after_events + i * N_PERF_EVENTS);
+}
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
+             int64_t *before_events,
+             int64_t *after_events,
              uint8_t *input_data,
              int mode)
 {
@@ -79,9 +104,9 @@ void measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            measure_start(before_ticks, before_events, i);
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
+            measure_stop(after_ticks, after_events, i);
             dut_free();
         }
         break;
@@ -92,9 +117,9 @@ void measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            measure_start(before_ticks, before_events, i);
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
+            measure_stop(after_ticks, after_events, i);
             dut_free();
         }
         break;
@@ -104,9 +129,9 @@ void measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            measure_start(before_ticks, before_events, i);
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            measure_stop(after_ticks, after_events, i);
             if (e)
                 q_release_element(e);
             dut_free();
@@ -118,9 +143,9 @@ void measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            measure_start(before_ticks, before_events, i);
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            measure_stop(after_ticks, after_events, i);
             if (e)
                 q_release_element(e);
             dut_free();
@@ -132,9 +157,9 @@ void measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            measure_start(before_ticks, before_events, i);
             dut_size(1);
-            after_ticks[i] = cpucycles();
+            measure_stop(after_ticks, after_events, i);
             dut_free();
         }
     }
@@ -30,6 +30,8 @@ void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
+             int64_t *before_events,
+             int64_t *after_events,
              uint8_t *input_data,
              int mode);
 
@@ -1,10 +1,18 @@
 #include <stdint.h>
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+
+/* Read the cycle counter at the beginning of a measured region.
+ * The fences keep the measured code from being hoisted above the read, and
+ * keep earlier work from leaking into the region.
+ */
+static inline int64_t cpucycles_start(void)
 {
 #if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "memory");
     return ((int64_t) lo) | (((int64_t) hi) << 32);
 
 #elif defined(__aarch64__)
@@ -14,8 +22,34 @@ static inline int64_t cpucycles(void)
      * must be 64 bits wide.  So the system counter could be less than 64
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
+     *
+     * The counter read may be speculated, so synchronize the context on
+     * both sides of it.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+/* Read the cycle counter at the end of a measured region.
+ * rdtscp waits until all previous instructions have executed, and the
+ * trailing lfence keeps later instructions from starting before the read.
+ */
+static inline int64_t cpucycles_stop(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
     return val;
 #else
 #error Unsupported Architecture
@@ -24,10 +24,22 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - reading the cycle counter has a cost of its own. At startup we time a
+ *    number of empty regions and subtract the fastest of them from every
+ *    sample, so the measurements only contain the code under test. The
+ *    calibration is repeated until the overhead itself is stable, i.e. its
+ *    standard deviation is small compared to its mean.
+ *
+ *  - with the "perf" option set, instruction, cache miss and branch miss
+ *    counts are sampled around the same operations and fed into t-tests of
+ *    their own. They do not decide the verdict, but tell which part of the
+ *    machine a timing leak comes from.
  */
 
 #include "fixture.h"
 #include <assert.h>
+#include <malloc.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -35,17 +47,31 @@
 #include <string.h>
 #include "../console.h"
 #include "../random.h"
+#include "../report.h"
 #include "constant.h"
+#include "cpucycles.h"
+#include "perfcounter.h"
 #include "ttest.h"
 
 #define enough_measure 10000
 #define test_tries 10
 
+#define calibrate_samples 1000
+#define calibrate_tries 10
+
 extern const int drop_size;
 extern const size_t chunk_size;
 extern const size_t n_measure;
 static t_ctx *t;
 
+/* Sample hardware counters as well (set through option perf) */
+int perf_counters = 0;
+static bool use_events = false;
+static t_ctx t_events[N_PERF_EVENTS];
+
+/* Cost of an empty measured region, found by calibrate_overhead() */
+static int64_t timer_overhead = -1;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
@@ -57,12 +83,73 @@ static void __attribute__((noreturn)) die(void)
     exit(111);
 }
 
+/* Allocate zeroed memory accounted to dudect, or die */
+static void *dudect_calloc(size_t nmemb, size_t size)
+{
+    void *p = calloc(nmemb, size);
+    if (!p)
+        die();
+    mem_alloc_account(MEM_DUDECT, nmemb * size, malloc_usable_size(p));
+    return p;
+}
+
+static void dudect_free(void *p, size_t nmemb, size_t size)
+{
+    if (!p)
+        return;
+    mem_free_account(MEM_DUDECT, nmemb * size, malloc_usable_size(p));
+    free(p);
+}
+
+/* Measure the overhead of reading the cycle counter around an empty region.
+ * Keep the minimum of the most stable batch: it is the part of every sample
+ * which does not belong to the code under test.
+ */
+static void calibrate_overhead(void)
+{
+    double best_var = -1;
+
+    for (int cnt = 0; cnt < calibrate_tries; cnt++) {
+        int64_t min = INT64_MAX;
+        double mean = 0.0, m2 = 0.0;
+
+        for (int i = 1; i <= calibrate_samples; i++) {
+            int64_t before = cpucycles_start();
+            int64_t after = cpucycles_stop();
+            int64_t delta = after - before;
+            if (delta < min)
+                min = delta;
+
+            /* Welford method, as in ttest.c */
+            double d = delta - mean;
+            mean += d / i;
+            m2 += d * (delta - mean);
+        }
+
+        double var = m2 / (calibrate_samples - 1);
+        if (best_var < 0 || var < best_var) {
+            best_var = var;
+            timer_overhead = min > 0 ? min : 0;
+        }
+        /* Overhead is stable enough: stddev within 10% of the mean */
+        if (var <= 0.01 * mean * mean)
+            break;
+    }
+}
+
 static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
-    for (size_t i = 0; i < n_measure; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+    for (size_t i = 0; i < n_measure; i++) {
+        int64_t difference = after_ticks[i] - before_ticks[i];
+        /* Subtract the timer cost, keeping samples as fast as an empty
+         * region positive. Overflowed or dropped measurements stay
+         * non-positive and are skipped by update_statistics().
+         */
+        exec_times[i] =
+            difference > 0 ? difference - timer_overhead + 1 : difference;
+    }
 }
 
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
@@ -78,7 +165,45 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
     }
 }
 
-static bool report(void)
+static void update_event_statistics(const int64_t *before_events,
+                                    const int64_t *after_events,
+                                    const int64_t *exec_times,
+                                    uint8_t *classes)
+{
+    for (size_t i = 0; i < n_measure; i++) {
+        /* Keep the same samples as the cycle t-test */
+        if (exec_times[i] <= 0)
+            continue;
+
+        for (int e = 0; e < N_PERF_EVENTS; e++) {
+            size_t k = i * N_PERF_EVENTS + e;
+            t_push(&t_events[e], after_events[k] - before_events[k],
+                   classes[i]);
+        }
+    }
+}
+
+/* Show which hardware counter differs between the two classes */
+static void report_events(void)
+{
+    for (int e = 0; e < N_PERF_EVENTS; e++) {
+        if (!perf_counter_available(e)) {
+            printf("  %-14s unavailable\n", perf_counter_name(e));
+            continue;
+        }
+
+        double max_t = fabs(t_compute(&t_events[e]));
+        /* Both classes counted exactly the same events every time */
+        if (isnan(max_t))
+            max_t = 0;
+        printf("  %-14s mean: %10.1f / %10.1f, max t: %+7.2f%s\n",
+               perf_counter_name(e), t_events[e].mean[0],
+               t_events[e].mean[1], max_t,
+               max_t > t_threshold_moderate ? "  <-- leaks" : "");
+    }
+}
+
+static bool report_test(void)
 {
     double max_t = fabs(t_compute(t));
     double number_traces_max_t = t->n[0] + t->n[1];
@@ -119,29 +244,39 @@ static bool report(void)
 
 static bool doit(int mode)
 {
-    int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(n_measure, sizeof(int64_t));
-    uint8_t *classes = calloc(n_measure, sizeof(uint8_t));
-    uint8_t *input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    int64_t *before_ticks = dudect_calloc(n_measure + 1, sizeof(int64_t));
+    int64_t *after_ticks = dudect_calloc(n_measure + 1, sizeof(int64_t));
+    int64_t *exec_times = dudect_calloc(n_measure, sizeof(int64_t));
+    uint8_t *classes = dudect_calloc(n_measure, sizeof(uint8_t));
+    uint8_t *input_data =
+        dudect_calloc(n_measure * chunk_size, sizeof(uint8_t));
+    int64_t *before_events = NULL;
+    int64_t *after_events = NULL;
+    size_t n_events = (n_measure + 1) * N_PERF_EVENTS;
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
+    if (use_events) {
+        before_events = dudect_calloc(n_events, sizeof(int64_t));
+        after_events = dudect_calloc(n_events, sizeof(int64_t));
     }
 
     prepare_inputs(input_data, classes);
 
-    measure(before_ticks, after_ticks, input_data, mode);
+    measure(before_ticks, after_ticks, before_events, after_events,
+            input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
     update_statistics(exec_times, classes);
-    bool ret = report();
+    if (use_events)
+        update_event_statistics(before_events, after_events, exec_times,
+                                classes);
+    bool ret = report_test();
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+    dudect_free(before_events, n_events, sizeof(int64_t));
+    dudect_free(after_events, n_events, sizeof(int64_t));
+    dudect_free(before_ticks, n_measure + 1, sizeof(int64_t));
+    dudect_free(after_ticks, n_measure + 1, sizeof(int64_t));
+    dudect_free(exec_times, n_measure, sizeof(int64_t));
+    dudect_free(classes, n_measure, sizeof(uint8_t));
+    dudect_free(input_data, n_measure * chunk_size, sizeof(uint8_t));
 
     return ret;
 }
@@ -150,12 +285,26 @@ static void init_once(void)
 {
     init_dut();
     t_init(t);
+    for (int e = 0; e < N_PERF_EVENTS; e++)
+        t_init(&t_events[e]);
+    if (timer_overhead < 0)
+        calibrate_overhead();
 }
 
 static bool TEST_CONST(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    t = dudect_calloc(1, sizeof(t_ctx));
+
+    /* Progress below is printed straight to stdout */
+    report_flush();
+
+    use_events = false;
+    if (perf_counters) {
+        use_events = perf_counters_open();
+        if (!use_events)
+            printf("Hardware counters unavailable, measuring cycles only\n");
+    }
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
@@ -167,7 +316,12 @@ static bool TEST_CONST(char *text, int mode)
         if (result == true)
             break;
     }
-    free(t);
+
+    if (use_events) {
+        report_events();
+        perf_counters_close();
+    }
+    dudect_free(t, 1, sizeof(t_ctx));
     return result;
 }
 
@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Also sample hardware counters while testing (0 = cycles only) */
+extern int perf_counters;
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
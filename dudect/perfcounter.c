@@ -0,0 +1,96 @@
+/* Read hardware performance counters with perf_event_open(2).
+ *
+ * Counters are opened per thread, count user space only, and are read with
+ * a plain read() on each file descriptor.  When the kernel does not provide
+ * perf events (non-Linux systems, containers, restrictive
+ * perf_event_paranoid settings) every event is reported as unavailable and
+ * the caller keeps measuring cycles only.
+ */
+
+#include "perfcounter.h"
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static int fds[N_PERF_EVENTS] = {-1, -1, -1};
+
+static const char *names[N_PERF_EVENTS] = {
+    [perf_instructions] = "instructions",
+    [perf_cache_misses] = "cache-misses",
+    [perf_branch_misses] = "branch-misses",
+};
+
+#if defined(__linux__)
+static const uint64_t configs[N_PERF_EVENTS] = {
+    [perf_instructions] = PERF_COUNT_HW_INSTRUCTIONS,
+    [perf_cache_misses] = PERF_COUNT_HW_CACHE_MISSES,
+    [perf_branch_misses] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int open_event(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+#endif
+
+bool perf_counters_open(void)
+{
+    bool any = false;
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+#if defined(__linux__)
+        if (fds[i] < 0)
+            fds[i] = open_event(configs[i]);
+#endif
+        any = any || fds[i] >= 0;
+    }
+    return any;
+}
+
+void perf_counters_close(void)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+bool perf_counter_available(int event)
+{
+    return fds[event] >= 0;
+}
+
+const char *perf_counter_name(int event)
+{
+    return names[event];
+}
+
+void perf_counters_read(int64_t *vals)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        uint64_t v = 0;
+        if (fds[i] >= 0 && read(fds[i], &v, sizeof(v)) != sizeof(v))
+            v = 0;
+        vals[i] = (int64_t) v;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef DUDECT_PERFCOUNTER_H
+#define DUDECT_PERFCOUNTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware events sampled around each measured operation */
+enum {
+    perf_instructions,
+    perf_cache_misses,
+    perf_branch_misses,
+    N_PERF_EVENTS,
+};
+
+/* Open the counters.  Return false if none of them is available */
+bool perf_counters_open(void);
+
+/* Release the counters opened by perf_counters_open() */
+void perf_counters_close(void);
+
+/* Whether the given event could be opened */
+bool perf_counter_available(int event);
+
+/* Name of the given event, as shown in reports */
+const char *perf_counter_name(int event);
+
+/* Store current value of every event in vals.  Missing events read 0 */
+void perf_counters_read(int64_t *vals);
+
+#endif
@@ -0,0 +1,154 @@
+/* JSON-lines event stream for qtest */
+
+#include "events.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "report.h"
+
+/* Longest event line.  Arguments that don't fit are cut short */
+#define EVENT_LINE_MAX 4096
+
+/* Room kept for the fields after the arguments */
+#define EVENT_TAIL_ROOM 1024
+
+static int event_fd = -1;
+static char line[EVENT_LINE_MAX];
+static size_t line_len = 0;
+
+/* Counters when the running command started */
+static struct timespec start_wall, start_cpu;
+static mem_counters_t start_mem;
+static size_t start_errors;
+
+static void put(const char *s, size_t len)
+{
+    if (len > EVENT_LINE_MAX - line_len)
+        len = EVENT_LINE_MAX - line_len;
+    memcpy(line + line_len, s, len);
+    line_len += len;
+}
+
+static void put_str(const char *s)
+{
+    put(s, strlen(s));
+}
+
+static void put_fmt(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + line_len, EVENT_LINE_MAX - line_len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        line_len += (size_t) n < EVENT_LINE_MAX - line_len
+                        ? (size_t) n
+                        : EVENT_LINE_MAX - line_len - 1;
+}
+
+/* Append s as a JSON string, stopping when only limit bytes are left */
+static void put_json(const char *s, size_t limit)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    put("\"", 1);
+    for (; *s && line_len + 8 < limit; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', c};
+            put(esc, 2);
+        } else if (c < 0x20) {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            put(esc, 6);
+        } else {
+            put((char *) &c, 1);
+        }
+    }
+    put("\"", 1);
+}
+
+static double elapsed_us(const struct timespec *from, clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double) (now.tv_sec - from->tv_sec) * 1e6 +
+           (double) (now.tv_nsec - from->tv_nsec) * 1e-3;
+}
+
+bool event_open(const char *file_name)
+{
+    event_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return event_fd >= 0;
+}
+
+void event_close(void)
+{
+    if (event_fd < 0)
+        return;
+    close(event_fd);
+    event_fd = -1;
+}
+
+void event_begin(void)
+{
+    if (event_fd < 0)
+        return;
+    mem_counters(MEM_QUEUE, &start_mem);
+    start_errors = report_error_count();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu);
+    clock_gettime(CLOCK_MONOTONIC, &start_wall);
+}
+
+void event_end(size_t index, int argc, char *argv[], bool ok)
+{
+    if (event_fd < 0)
+        return;
+
+    /* Stop the clocks before formatting anything */
+    double wall = elapsed_us(&start_wall, CLOCK_MONOTONIC);
+    double cpu = elapsed_us(&start_cpu, CLOCK_PROCESS_CPUTIME_ID);
+    mem_counters_t mem;
+    mem_counters(MEM_QUEUE, &mem);
+    size_t errors = report_error_count() - start_errors;
+
+    line_len = 0;
+    put_fmt("{\"index\":%lu,\"cmd\":", index);
+    put_json(argc > 0 ? argv[0] : "", EVENT_LINE_MAX - EVENT_TAIL_ROOM);
+    put_str(",\"args\":[");
+    for (int i = 1; i < argc; i++) {
+        if (line_len + 16 > EVENT_LINE_MAX - EVENT_TAIL_ROOM)
+            break;
+        if (i > 1)
+            put(",", 1);
+        put_json(argv[i], EVENT_LINE_MAX - EVENT_TAIL_ROOM);
+    }
+    put_fmt("],\"ok\":%s,\"wall_us\":%.3f,\"cpu_us\":%.3f",
+            ok ? "true" : "false", wall, cpu);
+    put_fmt(
+        ",\"alloc\":{\"count\":%lu,\"bytes\":%lu,\"freed\":%lu,"
+        "\"freed_bytes\":%lu,\"live_bytes\":%lu}",
+        mem.allocate_cnt - start_mem.allocate_cnt,
+        mem.allocate_bytes - start_mem.allocate_bytes,
+        mem.free_cnt - start_mem.free_cnt,
+        mem.free_bytes - start_mem.free_bytes, mem.current_bytes);
+    put_fmt(",\"errors\":%lu", errors);
+    if (errors) {
+        put_str(",\"error\":");
+        put_json(report_last_error(), EVENT_LINE_MAX - 4);
+    }
+    put("}\n", 2);
+    /* A cut line still ends the record */
+    line[line_len - 1] = '\n';
+
+    for (size_t done = 0; done < line_len;) {
+        ssize_t n = write(event_fd, line + done, line_len - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+}
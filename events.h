@@ -0,0 +1,27 @@
+#ifndef LAB0_EVENTS_H
+#define LAB0_EVENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Structured event stream.  When open, every command interpreted adds one
+ * JSON object on a line of its own, with the command, its arguments and
+ * result, timings, queue allocation deltas and errors reported.
+ * Lines are built in a static buffer and written with a single write, so
+ * the stream allocates nothing and barely changes what it measures.
+ */
+
+/* Start writing events to file_name.  Return true if successful */
+bool event_open(const char *file_name);
+
+/* Flush and close the event stream */
+void event_close(void);
+
+/* Take a snapshot of counters before a command runs */
+void event_begin(void);
+
+/* Write the event of the command that just finished */
+void event_end(size_t index, int argc, char *argv[], bool ok);
+
+#endif /* LAB0_EVENTS_H */
@@ -0,0 +1,383 @@
+/* Workload generator for qtest traces */
+
+#include "gen.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "report.h"
+
+/* Longest string the generator writes */
+#define GEN_MAX_LEN 1000
+
+/* Lengths of the strings qtest makes up for RAND */
+#define RAND_LEN_MIN 5
+#define RAND_LEN_MAX 9
+
+/* Largest count accepted in a spec */
+#define GEN_MAX_COUNT 1e12
+
+static const char *op_names[GEN_OPS] = {"ih",   "it",      "rh",   "rt",
+                                        "dm",   "reverse", "sort", "swap",
+                                        "size", "dedup"};
+
+#define OP_IH 0
+#define OP_IT 1
+#define OP_RH 2
+#define OP_DM 4
+#define OP_DEDUP 9
+
+/* Operations taking an element out of the queue */
+#define op_removes(op) ((op) >= OP_RH && (op) <= OP_DM)
+
+typedef struct {
+    const gen_spec_t *spec;
+    FILE *f;
+    uint64_t x;      /* xorshift64* state */
+    bool use_rand;   /* Leave random strings to RAND */
+    size_t key;      /* Next key of the ascending sequence */
+    size_t key_len;  /* Characters in each key */
+    char last[GEN_MAX_LEN + 1];
+    bool have_last;
+    size_t size;     /* Elements known to be in the queue */
+
+    /* Run of equal inserts waiting to be written, as "it str n" */
+    const char *run_cmd;
+    char run_str[GEN_MAX_LEN + 1];
+    size_t run_len;
+} gen_state_t;
+
+void gen_spec_init(gen_spec_t *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->seed = 1;
+    spec->rounds = 1;
+    spec->size_min = spec->size_max = 1000;
+    spec->ops = 1000;
+    spec->len_min = RAND_LEN_MIN;
+    spec->len_max = RAND_LEN_MAX;
+    /* ih, it, rh and rt */
+    for (int op = OP_IH; op < OP_DM; op++)
+        spec->mix[op] = 1;
+}
+
+/* Parse a count, allowing forms such as 1e6 */
+static bool parse_count(const char *s, size_t *count)
+{
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || *end || !(v >= 0 && v <= GEN_MAX_COUNT) || v != floor(v))
+        return false;
+    *count = (size_t) v;
+    return true;
+}
+
+/* Parse "n" or "lo:hi" */
+static bool parse_range(const char *s, size_t *lo, size_t *hi)
+{
+    char buf[64];
+    const char *colon = strchr(s, ':');
+    if (!colon) {
+        if (!parse_count(s, lo))
+            return false;
+        *hi = *lo;
+        return true;
+    }
+    if (colon - s >= sizeof(buf))
+        return false;
+    memcpy(buf, s, colon - s);
+    buf[colon - s] = '\0';
+    return parse_count(buf, lo) && parse_count(colon + 1, hi) && *lo <= *hi;
+}
+
+static bool parse_percent(const char *s, int *percent)
+{
+    size_t v;
+    if (!parse_count(s, &v) || v > 100)
+        return false;
+    *percent = (int) v;
+    return true;
+}
+
+bool gen_spec_parse(gen_spec_t *spec, const char *setting)
+{
+    const char *value = strchr(setting, '=');
+    if (!value)
+        return false;
+    size_t key_len = value - setting;
+    value++;
+
+#define KEY_IS(k) (key_len == strlen(k) && !strncmp(setting, k, key_len))
+    size_t n;
+    if (KEY_IS("seed")) {
+        char *end;
+        spec->seed = strtoull(value, &end, 0);
+        return end != value && !*end;
+    }
+    if (KEY_IS("rounds"))
+        return parse_count(value, &spec->rounds) && spec->rounds > 0;
+    /* Not "size", which is an operation */
+    if (KEY_IS("fill"))
+        return parse_range(value, &spec->size_min, &spec->size_max);
+    if (KEY_IS("ops"))
+        return parse_count(value, &spec->ops);
+    if (KEY_IS("len"))
+        return parse_range(value, &spec->len_min, &spec->len_max) &&
+               spec->len_min > 0 && spec->len_max <= GEN_MAX_LEN;
+    if (KEY_IS("dup"))
+        return parse_percent(value, &spec->dup);
+    if (KEY_IS("sorted"))
+        return parse_percent(value, &spec->sorted);
+
+    for (int op = 0; op < GEN_OPS; op++) {
+        if (!KEY_IS(op_names[op]))
+            continue;
+        if (!parse_count(value, &n) || n > 1000000)
+            return false;
+        /* Naming any operation replaces the default mix */
+        if (!spec->mix_given) {
+            memset(spec->mix, 0, sizeof(spec->mix));
+            spec->mix_given = true;
+        }
+        spec->mix[op] = (unsigned) n;
+        return true;
+    }
+#undef KEY_IS
+    return false;
+}
+
+void gen_spec_help(int level)
+{
+    report(level, "\tseed=S        Seed of the generator (default 1)");
+    report(level, "\trounds=R      Fresh queues to fill (default 1)");
+    report(level,
+           "\tfill=N|LO:HI  Elements to fill each queue with, drawn "
+           "log-uniformly (default 1000)");
+    report(level, "\tops=N         Operations after each fill (default 1000)");
+    report(level,
+           "\tlen=N|LO:HI   String length (default %d:%d, made up by "
+           "qtest as RAND)",
+           RAND_LEN_MIN, RAND_LEN_MAX);
+    report(level, "\tdup=P         Percent of strings repeating the last one");
+    report(level,
+           "\tsorted=P      Percent of strings in ascending order, as keys "
+           "long enough to number fill+ops strings in base 26, which must "
+           "fit in the longest len");
+    report(level,
+           "\tOP=W          Weight of OP in the mix, for OP among ih it rh rt "
+           "dm reverse sort swap size dedup (default ih=it=rh=rt=1)");
+}
+
+/* Characters in each sorted key: enough to stay distinct through a round */
+static size_t key_length(const gen_spec_t *spec)
+{
+    size_t keys = spec->size_max + spec->ops;
+    size_t len = 1;
+    for (size_t span = 26; span < keys && len < GEN_MAX_LEN; span *= 26)
+        len++;
+    return len < spec->len_min ? spec->len_min : len;
+}
+
+bool gen_spec_check(const gen_spec_t *spec)
+{
+    if (spec->sorted && key_length(spec) > spec->len_max) {
+        report(1,
+               "Sorted keys for %lu strings take %lu characters, over len's "
+               "maximum of %lu",
+               spec->size_max + spec->ops, key_length(spec), spec->len_max);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t gen_next(gen_state_t *g)
+{
+    g->x ^= g->x >> 12;
+    g->x ^= g->x << 25;
+    g->x ^= g->x >> 27;
+    return g->x * 0x2545f4914f6cdd1d;
+}
+
+/* Value in [0, range) */
+static size_t gen_below(gen_state_t *g, size_t range)
+{
+    return (size_t) (((__uint128_t) gen_next(g) * range) >> 64);
+}
+
+static size_t draw_size(gen_state_t *g)
+{
+    const gen_spec_t *spec = g->spec;
+    if (spec->size_min == spec->size_max || spec->size_max == 0)
+        return spec->size_max;
+
+    double lo = log((double) (spec->size_min ? spec->size_min : 1));
+    double hi = log((double) spec->size_max + 1);
+    double u = (double) (gen_next(g) >> 11) / (double) (1ULL << 53);
+    size_t n = (size_t) exp(lo + u * (hi - lo));
+    return n < spec->size_min   ? spec->size_min
+           : n > spec->size_max ? spec->size_max
+                                : n;
+}
+
+/* The next key of the ascending sequence, written in base 26 */
+static void sorted_string(gen_state_t *g, char *buf)
+{
+    size_t k = g->key++;
+    for (size_t i = g->key_len; i-- > 0; k /= 26)
+        buf[i] = 'a' + k % 26;
+    buf[g->key_len] = '\0';
+}
+
+static void random_string(gen_state_t *g, char *buf)
+{
+    const gen_spec_t *spec = g->spec;
+    size_t len =
+        spec->len_min + gen_below(g, spec->len_max - spec->len_min + 1);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = 'a' + gen_below(g, 26);
+    buf[len] = '\0';
+}
+
+/* Pick the next string to insert.  Return false to use RAND instead */
+static bool next_string(gen_state_t *g, char *buf)
+{
+    const gen_spec_t *spec = g->spec;
+
+    if (g->have_last && (int) gen_below(g, 100) < spec->dup) {
+        strcpy(buf, g->last);
+        return true;
+    }
+    if ((int) gen_below(g, 100) < spec->sorted) {
+        sorted_string(g, buf);
+    } else if (g->use_rand) {
+        return false;
+    } else {
+        random_string(g, buf);
+    }
+    strcpy(g->last, buf);
+    g->have_last = true;
+    return true;
+}
+
+static void flush_run(gen_state_t *g)
+{
+    if (!g->run_len)
+        return;
+    if (g->run_len == 1)
+        fprintf(g->f, "%s %s\n", g->run_cmd, g->run_str);
+    else
+        fprintf(g->f, "%s %s %lu\n", g->run_cmd, g->run_str, g->run_len);
+    g->run_len = 0;
+}
+
+/* Insert with cmd, merging equal neighbours into one command */
+static void insert(gen_state_t *g, const char *cmd)
+{
+    char s[GEN_MAX_LEN + 1];
+    if (!next_string(g, s))
+        strcpy(s, "RAND");
+
+    if (g->run_len && (g->run_cmd != cmd || strcmp(g->run_str, s)))
+        flush_run(g);
+    if (!g->run_len) {
+        g->run_cmd = cmd;
+        strcpy(g->run_str, s);
+    }
+    g->run_len++;
+    g->size++;
+}
+
+/* Pick an operation by weight, leaving out removals from an empty queue */
+static int pick_op(gen_state_t *g)
+{
+    const gen_spec_t *spec = g->spec;
+    size_t total = 0;
+
+    for (int op = 0; op < GEN_OPS; op++) {
+        if (g->size || !op_removes(op))
+            total += spec->mix[op];
+    }
+    if (!total)
+        return -1;
+
+    size_t w = gen_below(g, total);
+    for (int op = 0; op < GEN_OPS; op++) {
+        if (!g->size && op_removes(op))
+            continue;
+        if (w < spec->mix[op])
+            return op;
+        w -= spec->mix[op];
+    }
+    return -1;
+}
+
+static void run_round(gen_state_t *g, size_t round)
+{
+    const gen_spec_t *spec = g->spec;
+    size_t n = draw_size(g);
+
+    fprintf(g->f, "# Round %lu: %lu elements\n", round + 1, n);
+    fprintf(g->f, round ? "free\nnew\n" : "new\n");
+    g->size = 0;
+    g->key = 0;
+    g->have_last = false;
+
+    for (size_t i = 0; i < n; i++)
+        insert(g, "it");
+    flush_run(g);
+
+    for (size_t i = 0; i < spec->ops; i++) {
+        int op = pick_op(g);
+        if (op < 0)
+            break;
+        if (op == OP_IH || op == OP_IT) {
+            insert(g, op_names[op]);
+            flush_run(g);
+            continue;
+        }
+        fprintf(g->f, "%s\n", op_names[op]);
+        if (op_removes(op))
+            g->size--;
+        /* No telling how many elements dedup removes */
+        if (op == OP_DEDUP)
+            g->size = 0;
+    }
+}
+
+bool gen_trace(const gen_spec_t *spec, const char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+    setvbuf(f, NULL, _IOFBF, 1 << 16);
+
+    gen_state_t g = {.spec = spec, .f = f};
+    g.x = spec->seed ? spec->seed : 0x9e3779b97f4a7c15;
+    /* Strings nobody refers to again can be made up by qtest */
+    g.use_rand = !spec->dup && spec->len_min == RAND_LEN_MIN &&
+                 spec->len_max == RAND_LEN_MAX;
+    g.key_len = key_length(spec);
+
+    fprintf(f,
+            "# Generated workload: seed=%lu rounds=%lu fill=%lu:%lu ops=%lu "
+            "len=%lu:%lu dup=%d sorted=%d\n",
+            (unsigned long) spec->seed, spec->rounds, spec->size_min,
+            spec->size_max, spec->ops, spec->len_min, spec->len_max,
+            spec->dup, spec->sorted);
+    fprintf(f, "#");
+    for (int op = 0; op < GEN_OPS; op++) {
+        if (spec->mix[op])
+            fprintf(f, " %s=%u", op_names[op], spec->mix[op]);
+    }
+    fprintf(f, "\n");
+    if (g.use_rand)
+        fprintf(f, "option seed %d\n", (int) (spec->seed & 0x7fffffff));
+
+    for (size_t r = 0; r < spec->rounds; r++)
+        run_round(&g, r);
+    fprintf(f, "free\n");
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,48 @@
+#ifndef LAB0_GEN_H
+#define LAB0_GEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Workload generator.  Writes a qtest trace from a spec: a number of rounds,
+ * each filling a fresh queue to a size drawn from a range, then running a
+ * mix of operations picked by weight.  The same spec and seed always give
+ * the same trace.
+ */
+
+/* Operations the mix may contain */
+#define GEN_OPS 10
+
+typedef struct {
+    uint64_t seed;
+    size_t rounds;
+    size_t size_min, size_max; /* Drawn log-uniformly per round */
+    size_t ops;                /* Operations per round after filling */
+    size_t len_min, len_max;   /* String length, uniform */
+    int dup;                   /* Percent of strings repeating an earlier one */
+    int sorted;                /* Percent of strings in ascending order */
+    unsigned mix[GEN_OPS];     /* Weight of each operation */
+    bool mix_given;
+} gen_spec_t;
+
+/* Set spec to the defaults */
+void gen_spec_init(gen_spec_t *spec);
+
+/* Apply one key=value setting to spec.  Return true if successful */
+bool gen_spec_parse(gen_spec_t *spec, const char *setting);
+
+/*
+ * Check that the settings of spec fit together, reporting the first that
+ * doesn't.  Return true if they do
+ */
+bool gen_spec_check(const gen_spec_t *spec);
+
+/* Describe the keys gen_spec_parse accepts */
+void gen_spec_help(int level);
+
+/* Write the trace of spec to file_name.  Return true if successful */
+bool gen_trace(const gen_spec_t *spec, const char *file_name);
+
+#endif /* LAB0_GEN_H */
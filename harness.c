@@ -1,14 +1,33 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* dladdr */
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <malloc.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
 
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#define __SANITIZE_ADDRESS__ 1
+#endif
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#endif
+
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
 #include "harness.h"
@@ -18,6 +37,9 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of a block placed against a guard page instead */
+#define MAGICGUARD 0xdeadbee5
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -27,6 +49,9 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Bytes filled at each end of a payload in fast-check mode */
+#define FILL_BOUND 8
+
 /* Data structures used by our code */
 
 /*
@@ -36,7 +61,11 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    /* Provenance, reported when the block leaks */
+    size_t seq;            /* Allocation sequence number */
+    const char *operation; /* Queue operation that allocated it, or NULL */
+    uint32_t cmd_index;    /* Command that allocated it */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
@@ -44,15 +73,141 @@ typedef struct BELE {
 static block_ele_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/* Allocations made so far, and index of the running command */
+static size_t alloc_seq = 0;
+static size_t cur_cmd_index = 0;
+
+/*
+ * Guard page mode.  Every payload ends flush against an inaccessible page,
+ * so the first byte written past it faults right away.  The header sits at
+ * the start of the page holding the byte before the payload, which keeps it
+ * aligned; no footer is needed.
+ *
+ * Blocks whose header and payload fit in one page come from a pool of
+ * two-page slots (data + guard) mapped GUARD_BATCH at a time.  Freed slots
+ * are made inaccessible and sit in a quarantine ring, so use after free
+ * faults too, before being recycled.  Larger blocks get their own mapping.
+ *
+ * Each guarded block takes two mappings, and vm.max_map_count caps them.
+ * Once no more can be made, new blocks get a header and footer as outside
+ * guard mode, until guarded blocks are released.  The header of a guarded
+ * block holds MAGICGUARD, and the word where a footer-checked header would
+ * keep its magic number is cleared, so header_of can tell them apart.
+ */
+#define GUARD_BATCH 256
+#define GUARD_QUARANTINE 4096
+
+static bool guard_mode = false;
+static size_t page_size = 0;
+static void *guard_free_slots = NULL;
+static void *guard_quarantine[GUARD_QUARANTINE];
+static size_t guard_quarantine_pos = 0;
+static bool guard_exhausted = false; /* Until a guarded block is released */
+static bool guard_warned = false;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Fill only the ends of payloads instead of all of it */
+int fast_check = 0;
+
+/*
+ * Fault injection.  Failures are drawn from a private xorshift64* generator,
+ * so a given seed and trace always fail the same allocations.  Scheduled
+ * faults count calls to test_malloc, optionally only those made inside one
+ * named operation.
+ */
+static uint64_t fault_state = 0x9e3779b97f4a7c15;
+static uint64_t fault_seed_value = 0;
+static fault_mode_t fault_mode = FAULT_OFF;
+static size_t fault_n = 0;
+static size_t fault_count = 0;
+static char fault_op[64] = "";
+
+/*
+ * Memory budgets.  queue_budget caps the live bytes of queue memory.  An
+ * operation budget caps what a single call of matching operations may
+ * allocate: a fixed number of bytes, plus the length of the string argument
+ * for per_len budgets.  Budgets match operations by longest name prefix, so
+ * "q_insert" covers both insert operations.
+ */
+#define MAX_BUDGETS 16
+
+typedef struct {
+    char op[32];
+    size_t bytes;
+    bool per_len;
+} op_budget_t;
+
+int queue_budget = 0;
+static op_budget_t budgets[MAX_BUDGETS];
+static int budget_count = 0;
+
+/* Budget of the running operation, and bytes charged to it by this call */
+static const op_budget_t *cur_budget = NULL;
+static size_t op_len = 0;
+static size_t op_bytes = 0;
+
+/*
+ * Allocation site profiler.  Each allocation records its call site, or a
+ * short backtrace ending at it, in an open-addressing hash table keyed by
+ * the frames and the allocation function used.
+ */
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_INIT_SLOTS 1024
+
+typedef enum { ALLOC_MALLOC, ALLOC_CALLOC, ALLOC_STRDUP } alloc_kind_t;
+
+static const char *alloc_kind_name[] = {"malloc", "calloc", "strdup"};
+
+typedef struct {
+    size_t hash;
+    size_t calls;
+    size_t bytes;
+    alloc_kind_t kind;
+    int depth; /* 0 for an unused slot */
+    void *frames[PROFILE_MAX_DEPTH];
+} alloc_site_t;
+
+static int profile_depth = 0;
+static alloc_site_t *profile_sites = NULL;
+static size_t profile_slots = 0;
+static size_t profile_used = 0;
+
+/* Queue operation currently running, NULL when none */
+static const char *cur_operation = NULL;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/*
+ * Time budgets.  An operation may run for time_limit milliseconds, plus
+ * WORK_NS nanoseconds for each unit of work the caller declares, e.g. n log n
+ * for a sort.  The budget is enforced by a CLOCK_MONOTONIC timer raising
+ * SIGALRM, and the largest share of it each operation used is remembered.
+ */
+#define WORK_NS 200
+#define MAX_TIMED_OPS 32
+#define TIME_WARN_RATIO 0.8
+
+typedef struct {
+    const char *op;
+    size_t calls;
+    double max_ratio;   /* Largest elapsed / budget seen */
+    double max_elapsed; /* Elapsed seconds of that call */
+    double max_budget;  /* Budget of that call */
+} time_use_t;
+
+int time_limit = 1000;
+static double op_work = 0;
+static double op_time_budget = 0;
+static struct timespec op_start;
+static timer_t op_timer;
+static bool op_timer_created = false;
+static time_use_t time_use[MAX_TIMED_OPS];
+static int time_use_count = 0;
 
 /*
  * Data for managing exceptions
@@ -65,11 +220,168 @@ static bool time_limited = false;
  * Internal functions
  */
 
+static uint64_t fault_next()
+{
+    fault_state ^= fault_state >> 12;
+    fault_state ^= fault_state << 25;
+    fault_state ^= fault_state >> 27;
+    return fault_state * 0x2545f4914f6cdd1d;
+}
+
+static bool fault_inject()
+{
+    if (fault_op[0] &&
+        (!cur_operation || strcmp(fault_op, cur_operation) != 0))
+        return false;
+
+    fault_count++;
+    switch (fault_mode) {
+    case FAULT_NTH:
+        if (fault_count == fault_n)
+            return true;
+        break;
+    case FAULT_EVERY:
+        if (fault_count % fault_n == 0)
+            return true;
+        break;
+    default:
+        break;
+    }
+
+    if (!fail_probability)
+        return false;
+    /* Multiply-shift maps the draw onto [0, 100) */
+    uint64_t percent = ((__uint128_t) fault_next() * 100) >> 64;
+    return percent < (uint64_t) fail_probability;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static inline bool fail_allocation()
+{
+    /* Nothing armed: skip the generator entirely */
+    if (!fail_probability && fault_mode == FAULT_OFF)
+        return false;
+    return fault_inject();
+}
+
+/* Is a block with given payload size served from the slot pool? */
+static inline bool guard_is_small(size_t size)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return size + sizeof(block_ele_t) <= page_size;
+}
+
+/* Map a batch of slots, each a data page followed by a guard page */
+static bool guard_refill()
+{
+    size_t slot = 2 * page_size;
+    unsigned char *chunk = mmap(NULL, GUARD_BATCH * slot, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+        return false;
+
+    for (size_t i = 0; i < GUARD_BATCH; i++) {
+        unsigned char *s = chunk + i * slot;
+        if (mprotect(s, page_size, PROT_READ | PROT_WRITE)) {
+            munmap(s, (GUARD_BATCH - i) * slot);
+            return guard_free_slots != NULL;
+        }
+        *(void **) s = guard_free_slots;
+        guard_free_slots = s;
+    }
+    return true;
+}
+
+/*
+ * Allocate room for header and payload against a guard page.
+ * Return payload, or NULL if no more mappings can be created.
+ */
+static void *guard_alloc(size_t size)
+{
+    unsigned char *base, *guard;
+    if (guard_is_small(size)) {
+        if (!guard_free_slots && !guard_refill())
+            return NULL;
+        base = guard_free_slots;
+        guard_free_slots = *(void **) base;
+        guard = base + page_size;
+    } else {
+        size_t data = (size + sizeof(block_ele_t) + page_size - 1) &
+                      ~(page_size - 1);
+        base = mmap(NULL, data + page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        guard = base + data;
+        if (mprotect(guard, page_size, PROT_NONE)) {
+            munmap(base, data + page_size);
+            return NULL;
+        }
+    }
+
+    unsigned char *p = guard - size;
+    if (p != base + sizeof(block_ele_t))
+        ((block_ele_t *) (p - sizeof(block_ele_t)))->magic_header = 0;
+    return p;
+}
+
+/* Return the memory of a guarded block */
+static void guard_release(block_ele_t *b, void *p)
+{
+    size_t size = b->payload_size;
+    /* Mappings may be available again */
+    guard_exhausted = false;
+    if (!guard_is_small(size)) {
+        unsigned char *guard = (unsigned char *) p + size;
+        munmap(b, guard + page_size - (unsigned char *) b);
+        return;
+    }
+
+    /* Recycle the oldest quarantined slot to make room */
+    void *old = guard_quarantine[guard_quarantine_pos];
+    if (old && !mprotect(old, page_size, PROT_READ | PROT_WRITE)) {
+        *(void **) old = guard_free_slots;
+        guard_free_slots = old;
+    }
+    mprotect(b, page_size, PROT_NONE);
+    guard_quarantine[guard_quarantine_pos] = b;
+    guard_quarantine_pos = (guard_quarantine_pos + 1) % GUARD_QUARANTINE;
+}
+
+/* Bytes held for a guarded block of given payload size */
+static size_t guard_usable(size_t size)
+{
+    if (guard_is_small(size))
+        return 2 * page_size;
+    return ((size + sizeof(block_ele_t) + page_size - 1) & ~(page_size - 1)) +
+           page_size;
+}
+
+/* Locate header of a block, given its payload */
+static inline block_ele_t *header_of(void *p)
+{
+    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    if (!guard_mode || b->magic_header == MAGICHEADER)
+        return b;
+    return (block_ele_t *) ((size_t) b & ~(page_size - 1));
+}
+
+/* Is the block placed against a guard page, rather than checked by footer? */
+static inline bool is_guarded(const block_ele_t *b)
+{
+    return b->magic_header == MAGICGUARD;
+}
+
+/* Locate payload of a block, given its header */
+static inline void *payload_of(block_ele_t *b)
+{
+    if (!is_guarded(b))
+        return b->payload;
+    size_t size = b->payload_size;
+    size_t data = guard_is_small(size) ? page_size
+                                       : (size + sizeof(block_ele_t) +
+                                          page_size - 1) &
+                                             ~(page_size - 1);
+    return (unsigned char *) b + data - size;
 }
 
 /*
@@ -83,7 +395,7 @@ static block_ele_t *find_header(void *p)
         error_occurred = true;
     }
 
-    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    block_ele_t *b = header_of(p);
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
         block_ele_t *ab = allocated;
@@ -100,7 +412,7 @@ static block_ele_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -119,10 +431,250 @@ static size_t *find_footer(block_ele_t *b)
     return p;
 }
 
+static size_t profile_hash(void **frames, int depth, alloc_kind_t kind)
+{
+    size_t h = 14695981039346656037UL ^ kind;
+    for (int i = 0; i < depth; i++) {
+        h ^= (size_t) frames[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static alloc_site_t *profile_find(alloc_site_t *sites,
+                                  size_t slots,
+                                  size_t hash,
+                                  void **frames,
+                                  int depth,
+                                  alloc_kind_t kind)
+{
+    for (size_t i = hash & (slots - 1);; i = (i + 1) & (slots - 1)) {
+        alloc_site_t *e = &sites[i];
+        if (!e->depth ||
+            (e->hash == hash && e->kind == kind && e->depth == depth &&
+             !memcmp(e->frames, frames, depth * sizeof(void *))))
+            return e;
+    }
+}
+
+/* Double the table once it is 3/4 full.  Return false if out of memory */
+static bool profile_grow()
+{
+    size_t slots = profile_slots ? profile_slots * 2 : PROFILE_INIT_SLOTS;
+    alloc_site_t *sites = calloc(slots, sizeof(alloc_site_t));
+    if (!sites)
+        return false;
+
+    for (size_t i = 0; i < profile_slots; i++) {
+        alloc_site_t *e = &profile_sites[i];
+        if (e->depth)
+            *profile_find(sites, slots, e->hash, e->frames, e->depth,
+                          e->kind) = *e;
+    }
+    free(profile_sites);
+    profile_sites = sites;
+    profile_slots = slots;
+    return true;
+}
+
+/* Account an allocation of size bytes made at site */
+static void __attribute__((noinline))
+profile_record(size_t size, alloc_kind_t kind, void *site)
+{
+    void *trace[PROFILE_MAX_DEPTH + 8];
+    void **frames = &site;
+    int depth = 1;
+
+    if (profile_depth > 1) {
+        /* Drop the frames inside the harness, up to the call site */
+        int n = backtrace(trace, PROFILE_MAX_DEPTH + 8);
+        for (int i = 0; i < n; i++) {
+            if (trace[i] == site) {
+                frames = &trace[i];
+                depth = n - i < profile_depth ? n - i : profile_depth;
+                break;
+            }
+        }
+    }
+
+    if (4 * (profile_used + 1) > 3 * profile_slots && !profile_grow())
+        return;
+
+    size_t hash = profile_hash(frames, depth, kind);
+    alloc_site_t *e = profile_find(profile_sites, profile_slots, hash, frames,
+                                   depth, kind);
+    if (!e->depth) {
+        e->hash = hash;
+        e->kind = kind;
+        e->depth = depth;
+        memcpy(e->frames, frames, depth * sizeof(void *));
+        profile_used++;
+    }
+    e->calls++;
+    e->bytes += size;
+}
+
+/* Write "symbol+offset" for a code address into buf */
+static void profile_symbol(void *addr, char *buf, size_t len)
+{
+    Dl_info info;
+    if (!dladdr(addr, &info)) {
+        snprintf(buf, len, "%p", addr);
+    } else if (info.dli_sname) {
+        snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                 (unsigned long) ((char *) addr - (char *) info.dli_saddr));
+    } else {
+        /* Static function: give the object and offset for addr2line */
+        const char *obj = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+0x%lx", obj ? obj + 1 : info.dli_fname,
+                 (unsigned long) ((char *) addr - (char *) info.dli_fbase));
+    }
+}
+
+static int profile_cmp(const void *a, const void *b)
+{
+    const alloc_site_t *x = *(const alloc_site_t **) a;
+    const alloc_site_t *y = *(const alloc_site_t **) b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+/* The budget with the longest op that name starts with, if any */
+static const op_budget_t *find_budget(const char *name)
+{
+    const op_budget_t *best = NULL;
+    size_t best_len = 0;
+
+    if (!name)
+        return NULL;
+    for (int i = 0; i < budget_count; i++) {
+        size_t len = strlen(budgets[i].op);
+        if (len >= best_len && !strncmp(budgets[i].op, name, len)) {
+            best = &budgets[i];
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+/* Charge size bytes to the budgets in force, or report which one it breaks */
+static bool budget_allows(size_t size)
+{
+    const char *op = cur_operation ? cur_operation : "Allocation outside queue";
+
+    if (queue_budget &&
+        mem_current_bytes(MEM_QUEUE) + size > (size_t) queue_budget) {
+        report_event(MSG_ERROR,
+                     "%s exceeded queue memory budget of %d bytes with %lu "
+                     "more",
+                     op, queue_budget, size);
+        error_occurred = true;
+        return false;
+    }
+
+    if (!cur_budget)
+        return true;
+
+    size_t limit = cur_budget->bytes + (cur_budget->per_len ? op_len : 0);
+    if (op_bytes + size > limit) {
+        report_event(MSG_ERROR,
+                     "%s allocated %lu bytes, over its budget of %lu bytes",
+                     op, op_bytes + size, limit);
+        error_occurred = true;
+        return false;
+    }
+    op_bytes += size;
+    return true;
+}
+
+/*
+ * Fill payload with FILLCHAR, so code relying on uninitialized or freed
+ * contents sees garbage.  Fast-check mode only fills a bounded prefix and
+ * suffix, which is where stale pointers and string terminators live.
+ */
+static void fill_payload(unsigned char *p, size_t size)
+{
+    if (!fast_check || size <= 2 * FILL_BOUND) {
+        memset(p, FILLCHAR, size);
+        return;
+    }
+    memset(p, FILLCHAR, FILL_BOUND);
+    memset(p + size - FILL_BOUND, FILLCHAR, FILL_BOUND);
+}
+
+/* Raise SIGALRM after seconds, with sub-second resolution when possible */
+static void timer_arm(double seconds)
+{
+    if (!op_timer_created) {
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_SIGNAL,
+            .sigev_signo = SIGALRM,
+        };
+        op_timer_created = timer_create(CLOCK_MONOTONIC, &sev, &op_timer) == 0;
+    }
+
+    if (!op_timer_created) {
+        alarm((unsigned) seconds + 1);
+        return;
+    }
+
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = (time_t) seconds;
+    its.it_value.tv_nsec = (long) ((seconds - (double) its.it_value.tv_sec) *
+                                   1e9);
+    /* A zero it_value would disarm the timer instead */
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+    timer_settime(op_timer, 0, &its, NULL);
+}
+
+static void timer_disarm()
+{
+    if (!op_timer_created) {
+        alarm(0);
+        return;
+    }
+
+    struct itimerspec its = {0};
+    timer_settime(op_timer, 0, &its, NULL);
+}
+
+/* Record how much of its time budget the finished operation used */
+static void time_record(bool timed_out)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double) (now.tv_sec - op_start.tv_sec) +
+                     (double) (now.tv_nsec - op_start.tv_nsec) * 1e-9;
+    double ratio = timed_out ? 1.0 : elapsed / op_time_budget;
+    const char *op = cur_operation ? cur_operation : "other";
+
+    time_use_t *u = NULL;
+    for (int i = 0; i < time_use_count; i++) {
+        if (!strcmp(time_use[i].op, op))
+            u = &time_use[i];
+    }
+    if (!u && time_use_count < MAX_TIMED_OPS) {
+        u = &time_use[time_use_count++];
+        *u = (time_use_t){.op = op};
+    }
+    if (u) {
+        u->calls++;
+        if (ratio >= u->max_ratio) {
+            u->max_ratio = ratio;
+            u->max_elapsed = elapsed;
+            u->max_budget = op_time_budget;
+        }
+    }
+
+    if (!timed_out && ratio >= TIME_WARN_RATIO)
+        report_event(MSG_WARN, "%s used %.0f%% of its %.3f s time budget", op,
+                     ratio * 100, op_time_budget);
+}
+
 /*
  * Implementation of application functions
  */
-void *test_malloc(size_t size)
+static void *alloc_block(size_t size, alloc_kind_t kind, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
@@ -134,20 +686,56 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    if (mem_exceeds_limit(size)) {
+        report_event(MSG_ERROR,
+                     "Exceeded memory limit of %d megabytes with %lu bytes",
+                     mblimit, size);
         error_occurred = true;
+        return NULL;
+    }
+
+    if (!budget_allows(size))
+        return NULL;
+
+    block_ele_t *new_block;
+    void *p = NULL;
+    if (guard_mode && !guard_exhausted) {
+        p = guard_alloc(size);
+        guard_exhausted = !p;
+        if (!p && !guard_warned) {
+            guard_warned = true;
+            report_event(MSG_WARN,
+                         "Couldn't map any more guard pages (see "
+                         "/proc/sys/vm/max_map_count), checking new blocks "
+                         "by footer instead");
+        }
+    }
+    bool guarded = p != NULL;
+    if (guarded) {
+        new_block = header_of(p);
+    } else {
+        new_block = malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+        if (!new_block) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
+        // cppcheck-suppress nullPointerRedundantCheck
+        p = (void *) &new_block->payload;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = guarded ? MAGICGUARD : MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
+    new_block->seq = ++alloc_seq;
+    new_block->operation = cur_operation;
+    new_block->cmd_index = cur_cmd_index;
+    if (!guarded) {
+        *find_footer(new_block) = MAGICFOOTER;
+        /* Under AddressSanitizer, writes past the payload trap immediately */
+        ASAN_POISON_MEMORY_REGION(find_footer(new_block), sizeof(size_t));
+    }
+    fill_payload(p, size);
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -157,10 +745,21 @@ void *test_malloc(size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    mem_alloc_account(MEM_QUEUE, size,
+                      guarded ? guard_usable(size)
+                              : malloc_usable_size(new_block));
+
+    if (profile_depth)
+        profile_record(size, kind, site);
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, ALLOC_MALLOC, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -168,7 +767,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    void *ptr = alloc_block(size, ALLOC_CALLOC, __builtin_return_address(0));
     memset(ptr, 0, size);
     return ptr;
 }
@@ -184,17 +783,25 @@ void test_free(void *p)
         return;
 
     block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    bool guarded = is_guarded(b);
+    if (!guarded) {
+        ASAN_UNPOISON_MEMORY_REGION(find_footer(b), sizeof(size_t));
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+#if defined(__SANITIZE_ADDRESS__)
+        /* AddressSanitizer reports any access to freed blocks on its own */
+        if (!fast_check)
+#endif
+            fill_payload(p, b->payload_size);
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_ele_t *bn = b->next;
@@ -206,7 +813,14 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
-    free(b);
+    if (guarded) {
+        mem_free_account(MEM_QUEUE, b->payload_size,
+                         guard_usable(b->payload_size));
+        guard_release(b, p);
+    } else {
+        mem_free_account(MEM_QUEUE, b->payload_size, malloc_usable_size(b));
+        free(b);
+    }
     allocated_count--;
 }
 
@@ -214,7 +828,7 @@ void test_free(void *p)
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, ALLOC_STRDUP, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -230,6 +844,356 @@ size_t allocation_check()
  * Implementation of functions for testing
  */
 
+/* Leaked blocks sharing command and operation */
+typedef struct {
+    const char *operation;
+    uint32_t cmd_index;
+    size_t blocks;
+    size_t bytes;
+    size_t first_seq;
+} leak_group_t;
+
+static int leak_cmp(const void *a, const void *b)
+{
+    const leak_group_t *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+/*
+ * Summarize blocks still allocated, grouped by command and operation.
+ * Groups are aggregated in a hash table, so huge leaks take linear time.
+ */
+void leak_report(int level, size_t top)
+{
+    if (!allocated_count)
+        return;
+
+    size_t slots = 64;
+    while (slots < 2 * allocated_count && slots < (1 << 20))
+        slots <<= 1;
+    leak_group_t *groups = calloc(slots, sizeof(leak_group_t));
+    if (!groups)
+        return;
+
+    size_t ngroups = 0;
+    for (block_ele_t *b = allocated; b; b = b->next) {
+        size_t h = ((size_t) b->operation >> 4) * 31 + b->cmd_index;
+        h ^= h >> 17;
+        h *= 0x9e3779b97f4a7c15;
+        size_t i = h & (slots - 1);
+        while (groups[i].blocks &&
+               (groups[i].cmd_index != b->cmd_index ||
+                groups[i].operation != b->operation)) {
+            i = (i + 1) & (slots - 1);
+        }
+
+        leak_group_t *g = &groups[i];
+        if (!g->blocks) {
+            /* Table full: account the rest to the current group */
+            if (ngroups == slots - 1)
+                g = &groups[(i + slots - 1) & (slots - 1)];
+            else {
+                g->cmd_index = b->cmd_index;
+                g->operation = b->operation;
+                g->first_seq = b->seq;
+                ngroups++;
+            }
+        }
+        g->blocks++;
+        g->bytes += b->payload_size;
+        if (b->seq < g->first_seq)
+            g->first_seq = b->seq;
+    }
+
+    /* Compact and sort groups by bytes */
+    size_t n = 0;
+    for (size_t i = 0; i < slots; i++) {
+        if (groups[i].blocks)
+            groups[n++] = groups[i];
+    }
+    qsort(groups, n, sizeof(leak_group_t), leak_cmp);
+
+    report(level, "%12s %14s %10s %8s  %s", "blocks", "bytes", "first seq",
+           "command", "operation");
+    for (size_t i = 0; i < n && i < top; i++) {
+        report(level, "%12lu %14lu %10lu %8u  %s", groups[i].blocks,
+               groups[i].bytes, groups[i].first_seq, groups[i].cmd_index,
+               groups[i].operation ? groups[i].operation : "-");
+    }
+    if (n > top)
+        report(level, "... %lu more groups", n - top);
+    free(groups);
+}
+
+/*
+ * Record the index of the command about to run
+ */
+void set_command_index(size_t index)
+{
+    cur_cmd_index = index;
+}
+
+/*
+ * Seed fault injection.  The same seed replays the same failures.
+ */
+void fault_seed(uint64_t seed)
+{
+    fault_seed_value = seed;
+    /* xorshift64* must not start from zero */
+    fault_state = seed ? seed : 0x9e3779b97f4a7c15;
+    fault_count = 0;
+}
+
+/*
+ * Schedule allocation failures.  FAULT_NTH fails the n-th allocation,
+ * FAULT_EVERY fails every n-th one.  Non-empty op restricts injection,
+ * including probability-based failures, to that operation.
+ */
+void fault_schedule(fault_mode_t mode, size_t n, const char *op)
+{
+    fault_mode = n ? mode : FAULT_OFF;
+    fault_n = n;
+    fault_count = 0;
+    snprintf(fault_op, sizeof(fault_op), "%s", op ? op : "");
+}
+
+/*
+ * Describe the fault injection settings
+ */
+void fault_show(int level)
+{
+    const char *mode = fault_mode == FAULT_NTH     ? "nth"
+                       : fault_mode == FAULT_EVERY ? "every"
+                                                   : "off";
+    report(level,
+           "Fault injection: seed %lu, schedule %s %lu, operation %s, "
+           "probability %d%%, %lu allocations counted",
+           (unsigned long) fault_seed_value, mode, fault_n,
+           fault_op[0] ? fault_op : "any", fail_probability, fault_count);
+}
+
+/*
+ * Start profiling allocation sites, recording depth frames per allocation
+ * (1 for the call site only).  0 stops profiling and drops the data.
+ */
+void set_alloc_profile(int depth)
+{
+    profile_depth = depth < 0                   ? 0
+                    : depth > PROFILE_MAX_DEPTH ? PROFILE_MAX_DEPTH
+                                                : depth;
+    if (!profile_depth) {
+        free(profile_sites);
+        profile_sites = NULL;
+        profile_slots = profile_used = 0;
+    }
+}
+
+/*
+ * Report the top allocation sites, by bytes allocated
+ */
+void alloc_profile_report(int level, size_t top)
+{
+    if (!profile_used) {
+        report(level, "No allocation sites recorded");
+        return;
+    }
+
+    alloc_site_t **sorted = malloc(profile_used * sizeof(alloc_site_t *));
+    if (!sorted)
+        return;
+    size_t n = 0;
+    for (size_t i = 0; i < profile_slots; i++) {
+        if (profile_sites[i].depth)
+            sorted[n++] = &profile_sites[i];
+    }
+    qsort(sorted, n, sizeof(alloc_site_t *), profile_cmp);
+
+    report(level, "%12s %14s  %s", "calls", "bytes", "allocation site");
+    for (size_t i = 0; i < n && i < top; i++) {
+        char sym[256];
+        profile_symbol(sorted[i]->frames[0], sym, sizeof(sym));
+        report(level, "%12lu %14lu  %s (%s)", sorted[i]->calls,
+               sorted[i]->bytes, sym, alloc_kind_name[sorted[i]->kind]);
+    }
+    if (n > top)
+        report(level, "... %lu more sites", n - top);
+    free(sorted);
+}
+
+/*
+ * Write allocation sites as collapsed stacks, one "outer;...;site bytes"
+ * line per site, as consumed by flamegraph.pl.  Return true if successful.
+ */
+bool alloc_profile_dump(char *file_name)
+{
+    FILE *f = fopen(file_name, "w");
+    if (!f)
+        return false;
+
+    for (size_t i = 0; i < profile_slots; i++) {
+        alloc_site_t *e = &profile_sites[i];
+        if (!e->depth)
+            continue;
+        for (int d = e->depth - 1; d >= 0; d--) {
+            char sym[256];
+            profile_symbol(e->frames[d], sym, sizeof(sym));
+            fprintf(f, "%s;", sym);
+        }
+        fprintf(f, "%s %lu\n", alloc_kind_name[e->kind], e->bytes);
+    }
+    return fclose(f) == 0;
+}
+
+/*
+ * Name the queue operation about to run.  Cleared by exception_cancel
+ */
+void set_operation(const char *name)
+{
+    cur_operation = name;
+    op_work = 0;
+    cur_budget = find_budget(name);
+    op_len = 0;
+    op_bytes = 0;
+}
+
+/*
+ * Start another call of the running operation, with a string argument of
+ * len characters.  Resets the bytes charged to its budget.
+ */
+void set_operation_len(size_t len)
+{
+    op_len = len;
+    op_bytes = 0;
+}
+
+/*
+ * Declare the work the running operation is expected to do, such as the
+ * queue length for a linear operation.  Its time budget grows with it.
+ */
+void set_operation_work(double work)
+{
+    op_work = work;
+}
+
+/*
+ * Show the largest share of its time budget each operation has used
+ */
+void time_budget_report(int level)
+{
+    if (!time_use_count)
+        return;
+
+    report(level, "%-16s %8s %12s %12s %7s", "operation", "calls",
+           "worst (s)", "budget (s)", "used");
+    for (int i = 0; i < time_use_count; i++) {
+        time_use_t *u = &time_use[i];
+        report(level, "%-16s %8lu %12.6f %12.3f %6.1f%%", u->op, u->calls,
+               u->max_elapsed, u->max_budget, u->max_ratio * 100);
+    }
+}
+
+/*
+ * Limit what each call of operations named op (or starting with op) may
+ * allocate.  Return false if the table is full.
+ */
+bool budget_set(const char *op, size_t bytes, bool per_len)
+{
+    op_budget_t *b = NULL;
+
+    for (int i = 0; i < budget_count; i++) {
+        if (!strcmp(budgets[i].op, op))
+            b = &budgets[i];
+    }
+    if (!b) {
+        if (budget_count == MAX_BUDGETS)
+            return false;
+        b = &budgets[budget_count++];
+        snprintf(b->op, sizeof(b->op), "%s", op);
+    }
+    b->bytes = bytes;
+    b->per_len = per_len;
+    return true;
+}
+
+/*
+ * Remove the budget of op, or all of them when op is NULL
+ */
+void budget_clear(const char *op)
+{
+    int kept = 0;
+
+    for (int i = 0; i < budget_count; i++) {
+        if (op && strcmp(budgets[i].op, op))
+            budgets[kept++] = budgets[i];
+    }
+    budget_count = kept;
+}
+
+/*
+ * Describe the memory budgets in force
+ */
+void budget_show(int level)
+{
+    if (queue_budget)
+        report(level, "Queue memory: %d bytes", queue_budget);
+    else
+        report(level, "Queue memory: unlimited");
+
+    for (int i = 0; i < budget_count; i++) {
+        if (budgets[i].per_len)
+            report(level, "%s: len+%lu bytes per call", budgets[i].op,
+                   budgets[i].bytes);
+        else
+            report(level, "%s: %lu bytes per call", budgets[i].op,
+                   budgets[i].bytes);
+    }
+}
+
+/*
+ * Start over for another test run in the same process.  Blocks left
+ * allocated are released, and fault schedules, budgets, time statistics and
+ * profiled sites are dropped.
+ */
+void harness_reset()
+{
+    noallocate_mode = false;
+    /* Cautious mode would search the whole list for every block */
+    cautious_mode = false;
+    while (allocated)
+        test_free(payload_of(allocated));
+    cautious_mode = true;
+    error_occurred = false;
+    cur_operation = NULL;
+    alloc_seq = 0;
+    cur_cmd_index = 0;
+
+    fault_schedule(FAULT_OFF, 0, NULL);
+    budget_clear(NULL);
+    time_use_count = 0;
+
+    int depth = profile_depth;
+    set_alloc_profile(0);
+    set_alloc_profile(depth);
+}
+
+/*
+ * Set/unset guard page mode.
+ * Only possible while no blocks are allocated.  Return true if successful.
+ */
+bool set_guard_mode(bool guard)
+{
+    if (guard == guard_mode)
+        return true;
+    if (allocated_count > 0)
+        return false;
+
+    if (!page_size)
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    guard_mode = guard;
+    guard_exhausted = guard_warned = false;
+    return true;
+}
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -268,7 +1232,8 @@ bool exception_setup(bool limit_time)
         /* Got here from longjmp */
         jmp_ready = false;
         if (time_limited) {
-            alarm(0);
+            timer_disarm();
+            time_record(true);
             time_limited = false;
         }
 
@@ -280,8 +1245,11 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    /* A time limit of 0 turns the timer off, e.g. under valgrind */
+    if (limit_time && time_limit > 0) {
+        op_time_budget = time_limit * 1e-3 + op_work * WORK_NS * 1e-9;
+        clock_gettime(CLOCK_MONOTONIC, &op_start);
+        timer_arm(op_time_budget);
         time_limited = true;
     }
     return true;
@@ -293,12 +1261,16 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        timer_disarm();
+        time_record(false);
         time_limited = false;
     }
 
     jmp_ready = false;
     error_message = "";
+    cur_operation = NULL;
+    cur_budget = NULL;
+    op_work = 0;
 }
 
 /*
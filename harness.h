@@ -4,6 +4,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * This test harness enables us to do stringent testing of code.
@@ -22,9 +23,127 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/*
+ * Summarize blocks still allocated, grouped by the command and queue
+ * operation that allocated them.  Show at most top groups, largest first.
+ */
+void leak_report(int level, size_t top);
+
+/*
+ * Record the index of the command about to run, for leak reports
+ */
+void set_command_index(size_t index);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Fill only a bounded prefix and suffix of allocated and freed payloads.
+ * Header and footer magic are checked as usual.
+ */
+extern int fast_check;
+
+/* Scheduled allocation failures */
+typedef enum { FAULT_OFF, FAULT_NTH, FAULT_EVERY } fault_mode_t;
+
+/*
+ * Seed fault injection.  The same seed replays the same failures.
+ */
+void fault_seed(uint64_t seed);
+
+/*
+ * Schedule allocation failures.  FAULT_NTH fails the n-th allocation,
+ * FAULT_EVERY fails every n-th one.  Non-empty op restricts injection,
+ * including probability-based failures, to that operation.
+ */
+void fault_schedule(fault_mode_t mode, size_t n, const char *op);
+
+/*
+ * Describe the fault injection settings at given verbosity level
+ */
+void fault_show(int level);
+
+/*
+ * Start profiling allocation sites, recording depth frames per allocation
+ * (1 for the call site only).  0 stops profiling and drops the data.
+ */
+void set_alloc_profile(int depth);
+
+/*
+ * Report the top allocation sites, by bytes allocated
+ */
+void alloc_profile_report(int level, size_t top);
+
+/*
+ * Write allocation sites as collapsed stacks for flamegraph.pl.
+ * Return true if successful.
+ */
+bool alloc_profile_dump(char *file_name);
+
+/*
+ * Name the queue operation about to run.  Cleared by exception_cancel
+ */
+void set_operation(const char *name);
+
+/*
+ * Start another call of the running operation, with a string argument of
+ * len characters.  Resets the bytes charged to its budget.
+ */
+void set_operation_len(size_t len);
+
+/*
+ * Declare the work the running operation is expected to do, such as the
+ * queue length for a linear operation.  Its time budget grows with it.
+ */
+void set_operation_work(double work);
+
+/*
+ * Time budget of any operation in milliseconds, before adding its work.
+ * 0 disables time limits.
+ */
+extern int time_limit;
+
+/*
+ * Show the largest share of its time budget each operation has used
+ */
+void time_budget_report(int level);
+
+/* Maximum live bytes of queue memory, 0 for no limit */
+extern int queue_budget;
+
+/*
+ * Limit what each call of operations named op (or starting with op) may
+ * allocate: bytes, plus the length of the string argument when per_len is
+ * set.  Allocations past the budget fail and are reported with the
+ * operation's name.  Return false if the table is full.
+ */
+bool budget_set(const char *op, size_t bytes, bool per_len);
+
+/*
+ * Remove the budget of op, or all of them when op is NULL
+ */
+void budget_clear(const char *op);
+
+/*
+ * Describe the memory budgets in force
+ */
+void budget_show(int level);
+
+/*
+ * Start over for another test run in the same process.  Blocks left
+ * allocated are released and per-run settings and statistics cleared.
+ * The fault seed is kept: reseed with fault_seed() as needed.
+ */
+void harness_reset();
+
+/*
+ * Set/unset guard page mode.
+ * In this mode, every payload ends against an inaccessible page, so
+ * overruns and uses after free fault immediately.
+ * Only possible while no blocks are allocated.  Return true if successful.
+ */
+bool set_guard_mode(bool guard);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
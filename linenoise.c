@@ -106,6 +106,7 @@
 #include "linenoise.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,6 +131,8 @@ static int atexit_registered = 0; /* Register atexit just 1 time. */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
 static char **history = NULL;
+/* Lines in the history file, compacted once it holds twice the history */
+static int history_file_lines = 0;
 
 /* The linenoiseState structure represents the state during line editing.
  * We pass this state to functions implementing specific editing
@@ -1298,6 +1301,38 @@ int linenoiseHistorySave(const char *filename)
     for (j = 0; j < history_len; j++)
         fprintf(fp, "%s\n", history[j]);
     fclose(fp);
+    history_file_lines = history_len;
+    return 0;
+}
+
+/* Append a line just added to the history at the end of the specified file,
+ * instead of saving the whole history again. Once the file holds twice the
+ * maximum history length, it is rewritten with the current history only.
+ * On success 0 is returned otherwise -1 is returned. */
+int linenoiseHistoryAppend(const char *filename, const char *line)
+{
+    if (history_file_lines >= 2 * history_max_len)
+        return linenoiseHistorySave(filename);
+
+    size_t len = strlen(line);
+    char *buf = malloc(len + 1);
+    if (!buf)
+        return -1;
+    memcpy(buf, line, len);
+    buf[len] = '\n';
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        free(buf);
+        return -1;
+    }
+    /* One write, so the line lands whole at the end of the file */
+    ssize_t n = write(fd, buf, len + 1);
+    close(fd);
+    free(buf);
+    if (n != (ssize_t) len + 1)
+        return -1;
+    history_file_lines++;
     return 0;
 }
 
@@ -1308,22 +1343,41 @@ int linenoiseHistorySave(const char *filename)
  * on error -1 is returned. */
 int linenoiseHistoryLoad(const char *filename)
 {
-    FILE *fp = fopen(filename, "r");
-    char buf[LINENOISE_MAX_LINE];
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    char *buf;
+    size_t size = 0;
 
-    if (fp == NULL)
+    if (fd < 0)
         return -1;
+    if (fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1))) {
+        close(fd);
+        return -1;
+    }
 
-    while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL) {
-        char *p;
-
-        p = strchr(buf, '\r');
-        if (!p)
-            p = strchr(buf, '\n');
+    /* The whole file at once, normally in a single read */
+    while (size < (size_t) st.st_size) {
+        ssize_t n = read(fd, buf + size, st.st_size - size);
+        if (n <= 0)
+            break;
+        size += n;
+    }
+    close(fd);
+    buf[size] = '\0';
+
+    history_file_lines = 0;
+    for (char *line = buf; line < buf + size;) {
+        char *end = memchr(line, '\n', buf + size - line);
+        if (!end)
+            end = buf + size;
+        *end = '\0';
+        char *p = strchr(line, '\r');
         if (p)
             *p = '\0';
-        linenoiseHistoryAdd(buf);
+        linenoiseHistoryAdd(line);
+        history_file_lines++;
+        line = end + 1;
     }
-    fclose(fp);
+    free(buf);
     return 0;
 }
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -13,7 +14,11 @@
 #include <time.h>
 #include <unistd.h>
 #include "dudect/fixture.h"
+#include "events.h"
+#include "gen.h"
 #include "list.h"
+#include "random.h"
+#include "sampler.h"
 
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
@@ -69,10 +74,35 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Number of groups shown when blocks leak */
+#define LEAK_GROUPS_SHOWN 10
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/* Work of an n log n operation, which sets its time budget */
+static double nlogn(size_t n)
+{
+    return n > 1 ? n * log2((double) n) : (double) n;
+}
+
+/*
+ * List integrity checks, run by show_queue.  Full mode follows the whole
+ * queue and verifies next->prev == cur for every node, which also rules out
+ * cycles that miss the head.  Sampled mode only verifies the nodes next to
+ * each end, where most operations work, plus a few short walks starting at
+ * random depths.  Operations that may touch any node still get a full check
+ * after them, whose cost is no larger than the operation's.
+ */
+typedef enum { CHECK_OFF, CHECK_SAMPLED, CHECK_FULL } check_mode_t;
+
+/* Integrity check mode (set through option integrity) */
+static int integrity = CHECK_FULL;
+
+/* Did the last operation only work at the ends of the queue? */
+static bool touched_ends = false;
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
@@ -90,6 +120,8 @@ static bool do_free(int argc, char *argv[])
 
     if (lcnt > big_list_size)
         set_cautious_mode(false);
+    set_operation("q_free");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
@@ -102,8 +134,10 @@ static bool do_free(int argc, char *argv[])
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
-               bcnt);
+        report_error(1,
+                     "ERROR: Freed queue, but %lu blocks are still allocated",
+                     bcnt);
+        leak_report(1, LEAK_GROUPS_SHOWN);
         ok = false;
     }
 
@@ -124,29 +158,62 @@ static bool do_new(int argc, char *argv[])
     }
     error_check();
 
+    set_operation("q_new");
     if (exception_setup(true)) {
         l_meta.l = q_new();
         l_meta.size = 0;
     }
     exception_cancel();
     lcnt = 0;
+    touched_ends = true;
     show_queue(3);
 
     return ok && !error_check();
 }
 
+/* Seed of random strings (set through option seed) */
+static int rand_seed = 0;
+
+/* Seeds drawn at startup, which every trace of a multi-trace run starts from */
+static uint64_t startup_fault_seed;
+static uint64_t startup_rand_seed;
+
+static void set_rand_seed(int oldval)
+{
+    prng_seed((uint64_t) rand_seed);
+}
+
+/*
+ * Take a value in [0, range) from *x by multiply-shift: the high half of
+ * x * range is the value, and the low half holds the randomness left for
+ * the next draw.
+ */
+static inline size_t rand_draw(uint64_t *x, size_t range)
+{
+    __uint128_t m = (__uint128_t) *x * range;
+    *x = (uint64_t) m;
+    return (size_t) (m >> 64);
+}
+
+/* Each draw over the charset consumes about 5 bits of a 64-bit word */
+#define RANDSTR_DRAWS_PER_WORD 12
+
 /*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+ * Fill buf with a string of MIN_RANDSTR_LEN to buf_size - 1 random letters.
+ * A string of MAX_RANDSTR_LEN characters, length included, comes from a
+ * single 64-bit PRNG draw.
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    uint64_t x = prng_next();
+    size_t len = buf_size - 1;
+    if (buf_size > MIN_RANDSTR_LEN)
+        len = MIN_RANDSTR_LEN + rand_draw(&x, buf_size - MIN_RANDSTR_LEN);
 
     for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+        if ((n + 1) % RANDSTR_DRAWS_PER_WORD == 0)
+            x = prng_next();
+        buf[n] = charset[rand_draw(&x, sizeof charset - 1)];
     }
     buf[len] = '\0';
 }
@@ -161,7 +228,7 @@ static bool do_ih(int argc, char *argv[])
         }
         bool ok = is_insert_head_const();
         if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+            report_error(1, "ERROR: Probably not constant time");
             return false;
         }
         report(1, "Probably constant time");
@@ -194,10 +261,13 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    set_operation("q_insert_head");
+    set_operation_work(reps);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            set_operation_len(strlen(inserts));
             bool rval = q_insert_head(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
@@ -205,18 +275,20 @@ static bool do_ih(int argc, char *argv[])
                 char *cur_inserts =
                     list_entry(l_meta.l->next, element_t, list)->value;
                 if (!cur_inserts) {
-                    report(1, "ERROR: Failed to save copy of string in queue");
+                    report_error(1,
+                                 "ERROR: Failed to save copy of string in "
+                                 "queue");
                     ok = false;
                 } else if (r == 0 && inserts == cur_inserts) {
-                    report(1,
-                           "ERROR: Need to allocate and copy string for new "
-                           "queue element");
+                    report_error(1,
+                                 "ERROR: Need to allocate and copy string for "
+                                 "new queue element");
                     ok = false;
                     break;
                 } else if (r == 1 && lasts == cur_inserts) {
-                    report(1,
-                           "ERROR: Need to allocate separate string for each "
-                           "queue element");
+                    report_error(1,
+                                 "ERROR: Need to allocate separate string for "
+                                 "each queue element");
                     ok = false;
                     break;
                 }
@@ -226,9 +298,10 @@ static bool do_ih(int argc, char *argv[])
                 if (fail_count < fail_limit)
                     report(2, "Insertion of %s failed", inserts);
                 else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                    report_error(1,
+                                 "ERROR: Insertion of %s failed (%d failures "
+                                 "total)",
+                                 inserts, fail_count);
                     ok = false;
                 }
             }
@@ -237,6 +310,7 @@ static bool do_ih(int argc, char *argv[])
     }
     exception_cancel();
 
+    touched_ends = true;
     show_queue(3);
     return ok;
 }
@@ -251,7 +325,7 @@ static bool do_it(int argc, char *argv[])
         }
         bool ok = is_insert_tail_const();
         if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+            report_error(1, "ERROR: Probably not constant time");
             return false;
         }
         report(1, "Probably constant time");
@@ -283,10 +357,13 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    set_operation("q_insert_tail");
+    set_operation_work(reps);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            set_operation_len(strlen(inserts));
             bool rval = q_insert_tail(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
@@ -294,7 +371,9 @@ static bool do_it(int argc, char *argv[])
                 char *cur_inserts =
                     list_entry(l_meta.l->prev, element_t, list)->value;
                 if (!cur_inserts) {
-                    report(1, "ERROR: Failed to save copy of string in queue");
+                    report_error(1,
+                                 "ERROR: Failed to save copy of string in "
+                                 "queue");
                     ok = false;
                 }
             } else {
@@ -302,9 +381,10 @@ static bool do_it(int argc, char *argv[])
                 if (fail_count < fail_limit)
                     report(2, "Insertion of %s failed", inserts);
                 else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                    report_error(1,
+                                 "ERROR: Insertion of %s failed (%d failures "
+                                 "total)",
+                                 inserts, fail_count);
                     ok = false;
                 }
             }
@@ -312,6 +392,7 @@ static bool do_it(int argc, char *argv[])
         }
     }
     exception_cancel();
+    touched_ends = true;
     show_queue(3);
     return ok;
 }
@@ -332,7 +413,7 @@ static bool do_remove(int option, int argc, char *argv[])
         }
         bool ok = option ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+            report_error(1, "ERROR: Probably not constant time");
             return false;
         }
         report(1, "Probably constant time");
@@ -376,6 +457,7 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
+    set_operation(option ? "q_remove_tail" : "q_remove_head");
     if (exception_setup(true))
         re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
                     : q_remove_head(l_meta.l, removes, string_length + 1);
@@ -390,7 +472,7 @@ static bool do_remove(int option, int argc, char *argv[])
 
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
-            report(1, "ERROR: Failed to store removed value");
+            report_error(1, "ERROR: Failed to store removed value");
             ok = false;
         }
 
@@ -402,9 +484,9 @@ static bool do_remove(int option, int argc, char *argv[])
         while ((i < string_length + STRINGPAD) && (removes[i] == 'X'))
             i++;
         if (i != string_length + STRINGPAD) {
-            report(1,
-                   "ERROR: copying of string in remove_head overflowed "
-                   "destination buffer.");
+            report_error(1,
+                         "ERROR: copying of string in remove_head overflowed "
+                         "destination buffer.");
             ok = false;
         } else {
             report(2, "Removed %s from queue", removes);
@@ -416,18 +498,20 @@ static bool do_remove(int option, int argc, char *argv[])
         if (!check && fail_count < fail_limit) {
             report(2, "Removal from queue failed");
         } else {
-            report(1, "ERROR: Removal from queue failed (%d failures total)",
-                   fail_count);
+            report_error(1,
+                         "ERROR: Removal from queue failed (%d failures total)",
+                         fail_count);
             ok = false;
         }
     }
 
     if (ok && check && strcmp(removes, checks)) {
-        report(1, "ERROR: Removed value %s != expected value %s", removes,
-               checks);
+        report_error(1, "ERROR: Removed value %s != expected value %s",
+                     removes, checks);
         ok = false;
     }
 
+    touched_ends = true;
     show_queue(3);
 
     free(removes);
@@ -460,6 +544,7 @@ static bool do_rhq(int argc, char *argv[])
 
     element_t *re = NULL;
 
+    set_operation("q_remove_head");
     if (exception_setup(true))
         re = q_remove_head(l_meta.l, NULL, 0);
     exception_cancel();
@@ -477,11 +562,13 @@ static bool do_rhq(int argc, char *argv[])
         if (fail_count < fail_limit)
             report(2, "Removal failed");
         else {
-            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
+            report_error(1, "ERROR: Removal failed (%d failures total)",
+                         fail_count);
             ok = false;
         }
     }
 
+    touched_ends = true;
     show_queue(3);
     return ok && !error_check();
 }
@@ -495,6 +582,8 @@ static bool do_dedup(int argc, char *argv[])
 
     bool ok = true;
     // set_noallocate_mode(true);
+    set_operation("q_delete_dup");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         ok = q_delete_dup(l_meta.l);
     exception_cancel();
@@ -502,7 +591,7 @@ static bool do_dedup(int argc, char *argv[])
     // set_noallocate_mode(false);
 
     if (!ok) {
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        report_error(1, "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
@@ -516,7 +605,7 @@ static bool do_dedup(int argc, char *argv[])
 
             // assume queue has been sorted
             if (strcmp(item->value, next_item->value) == 0) {
-                report(1, "ERROR: Contain duplicate string on queue");
+                report_error(1, "ERROR: Contain duplicate string on queue");
                 ok = false;
                 break;
             }
@@ -539,6 +628,8 @@ static bool do_reverse(int argc, char *argv[])
     error_check();
 
     set_noallocate_mode(true);
+    set_operation("q_reverse");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         q_reverse(l_meta.l);
     exception_cancel();
@@ -573,6 +664,8 @@ static bool do_size(int argc, char *argv[])
         report(3, "Warning: Calling size on null queue");
     error_check();
 
+    set_operation("q_size");
+    set_operation_work(l_meta.size);
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             cnt = q_size(l_meta.l);
@@ -585,13 +678,14 @@ static bool do_size(int argc, char *argv[])
         if (lcnt == cnt) {
             report(2, "Queue size = %d", cnt);
         } else {
-            report(1,
-                   "ERROR: Computed queue size as %d, but correct value is %d",
-                   cnt, (int) lcnt);
+            report_error(
+                1, "ERROR: Computed queue size as %d, but correct value is %d",
+                cnt, (int) lcnt);
             ok = false;
         }
     }
 
+    touched_ends = true;
     show_queue(3);
 
     return ok && !error_check();
@@ -614,6 +708,8 @@ bool do_sort(int argc, char *argv[])
     error_check();
 
     set_noallocate_mode(true);
+    set_operation("q_sort");
+    set_operation_work(nlogn(l_meta.size));
     if (exception_setup(true))
         q_sort(l_meta.l);
     exception_cancel();
@@ -629,7 +725,7 @@ bool do_sort(int argc, char *argv[])
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
             if (strcasecmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
+                report_error(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
@@ -652,6 +748,8 @@ static bool do_dm(int argc, char *argv[])
     error_check();
 
     bool ok = true;
+    set_operation("q_delete_mid");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         ok = q_delete_mid(l_meta.l);
     exception_cancel();
@@ -672,6 +770,8 @@ static bool do_swap(int argc, char *argv[])
     error_check();
 
     set_noallocate_mode(true);
+    set_operation("q_swap");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         q_swap(l_meta.l);
     exception_cancel();
@@ -682,51 +782,160 @@ static bool do_swap(int argc, char *argv[])
     return !error_check();
 }
 
-static bool is_circular()
+#define CHECK_END_NODES 16
+#define CHECK_PROBES 4
+#define CHECK_PROBE_DEPTH 1024
+#define CHECK_PROBE_NODES 8
+
+#define PROBE_SEED 0x853c49e6748fea9b
+
+static uint64_t probe_state = PROBE_SEED;
+
+/* Private generator, so checks don't shift the random string sequence */
+static uint64_t probe_next()
 {
-    struct list_head *cur = l_meta.l->next;
-    while (cur != l_meta.l) {
-        if (!cur)
+    probe_state ^= probe_state >> 12;
+    probe_state ^= probe_state << 25;
+    probe_state ^= probe_state >> 27;
+    return probe_state * 0x2545f4914f6cdd1d;
+}
+
+/* Verify the links of up to steps nodes from node, stopping at the head */
+static bool links_ok(struct list_head *node, size_t steps, bool forward)
+{
+    for (size_t i = 0; i < steps; i++) {
+        struct list_head *next = node->next, *prev = node->prev;
+        if (!next || !prev || next->prev != node || prev->next != node)
             return false;
-        cur = cur->next;
+        node = forward ? next : prev;
+        if (node == l_meta.l)
+            break;
     }
+    return true;
+}
+
+static bool is_circular(bool ends_only)
+{
+    struct list_head *head = l_meta.l;
+
+    if (integrity == CHECK_FULL || !ends_only)
+        return links_ok(head, SIZE_MAX, true);
 
-    cur = l_meta.l->prev;
-    while (cur != l_meta.l) {
-        if (!cur)
+    if (!links_ok(head, CHECK_END_NODES, true) ||
+        !links_ok(head, CHECK_END_NODES, false))
+        return false;
+
+    for (int i = 0; i < CHECK_PROBES; i++) {
+        uint64_t r = probe_next();
+        bool forward = r & 1;
+        size_t depth = (r >> 1) % CHECK_PROBE_DEPTH;
+        struct list_head *node = head;
+        /*
+         * The ends cover only CHECK_END_NODES nodes: check each link on the
+         * way, so a broken one is reported instead of followed
+         */
+        for (size_t d = 0; d < depth; d++) {
+            struct list_head *next = forward ? node->next : node->prev;
+            if (!next || (forward ? next->prev : next->next) != node)
+                return false;
+            node = next;
+            if (node == head)
+                break;
+        }
+        if (!links_ok(node, CHECK_PROBE_NODES, forward))
             return false;
-        cur = cur->prev;
     }
     return true;
 }
 
+/*
+ * Queue contents are formatted into show_buf and written out in one go,
+ * rather than through a report call per element.  The buffer is static
+ * because a fault while rendering longjmps back into show_queue.
+ */
+#define SHOW_BUFSIZE 16384
+
+static char show_buf[SHOW_BUFSIZE];
+static size_t show_len = 0;
+
+static void show_flush(int vlevel)
+{
+    report_write(vlevel, show_buf, show_len);
+    show_len = 0;
+}
+
+static void show_append(int vlevel, const char *s, size_t len)
+{
+    if (show_len + len > SHOW_BUFSIZE)
+        show_flush(vlevel);
+    if (len > SHOW_BUFSIZE) {
+        report_write(vlevel, s, len);
+        return;
+    }
+    memcpy(show_buf + show_len, s, len);
+    show_len += len;
+}
+
+/* Append the value of element e, cut at string_length characters */
+static void show_element(int vlevel, struct list_head *node, bool first)
+{
+    element_t *e = list_entry(node, element_t, list);
+    if (!first)
+        show_append(vlevel, " ", 1);
+    if (!e->value)
+        show_append(vlevel, "NULL", 4);
+    else
+        show_append(vlevel, e->value, strnlen(e->value, string_length));
+}
+
+static void show_end(int vlevel, const char *tail)
+{
+    show_append(vlevel, tail, strlen(tail));
+    show_flush(vlevel);
+}
+
 static bool show_queue(int vlevel)
 {
     bool ok = true;
     if (verblevel < vlevel)
         return true;
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!l_meta.l) {
         report(vlevel, "l = NULL");
         return true;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
-        return false;
+    bool ends_only = touched_ends;
+    touched_ends = false;
+    if (integrity != CHECK_OFF) {
+        bool circular = false;
+        set_operation_work(lcnt);
+        if (exception_setup(true))
+            circular = is_circular(ends_only);
+        exception_cancel();
+        if (!circular) {
+            report_error(vlevel, "ERROR:  Queue is not doubly circular");
+            return false;
+        }
     }
 
-    report_noreturn(vlevel, "l = [");
+    show_len = 0;
+    show_append(vlevel, "l = [", 5);
 
     struct list_head *ori = l_meta.l;
     struct list_head *cur = l_meta.l->next;
 
+    /* Only a full check walks past the elements shown to count them */
+    size_t limit = integrity == CHECK_FULL ? lcnt : big_list_size + 1;
+    if (limit > lcnt)
+        limit = lcnt;
+
+    set_operation_work(limit);
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < lcnt) {
-            element_t *e = list_entry(cur, element_t, list);
+        while (ok && ori != cur && cnt < limit) {
             if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                show_element(vlevel, cur, cnt == 0);
             cnt++;
             cur = cur->next;
             ok = ok && !error_check();
@@ -735,31 +944,258 @@ static bool show_queue(int vlevel)
     exception_cancel();
 
     if (!ok) {
-        report(vlevel, " ... ]");
+        show_end(vlevel, " ... ]\n");
         return false;
     }
 
     if (cur == ori) {
         if (cnt <= big_list_size)
-            report(vlevel, "]");
+            show_end(vlevel, "]\n");
         else
-            report(vlevel, " ... ]");
+            show_end(vlevel, " ... ]\n");
+    } else if (cnt < lcnt) {
+        show_end(vlevel, " ... ]\n");
     } else {
-        report(vlevel, " ... ]");
-        report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
+        show_end(vlevel, " ... ]\n");
+        report_error(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
         ok = false;
     }
 
     return ok;
 }
 
+/*
+ * Show elements first to last (counting from 0) only.  The walk starts from
+ * whichever end of the queue is closer, and checks the links it follows.
+ */
+static bool show_range(size_t first, size_t last)
+{
+    bool ok = true;
+
+    if (!l_meta.l) {
+        report(0, "l = NULL");
+        return true;
+    }
+    /* Nothing in range: show the range asked for, before clamping it */
+    if (first >= lcnt || first > last) {
+        report(0, "l[%lu..%lu] = []", first, last);
+        return true;
+    }
+    if (last >= lcnt)
+        last = lcnt - 1;
+
+    char head[64];
+    int len = snprintf(head, sizeof(head), "l[%lu..%lu] = [", first, last);
+    show_len = 0;
+    show_append(0, head, len);
+
+    struct list_head *cur = l_meta.l;
+    bool backward = first > lcnt / 2;
+    size_t steps = backward ? lcnt - first : first + 1;
+
+    set_operation_work(steps + last - first);
+    if (exception_setup(true)) {
+        for (size_t i = 0; ok && i < steps; i++) {
+            cur = backward ? cur->prev : cur->next;
+            ok = cur && cur != l_meta.l;
+        }
+        for (size_t i = first; ok && i <= last; i++) {
+            ok = links_ok(cur, 1, true);
+            if (ok) {
+                show_element(0, cur, i == first);
+                cur = cur->next;
+                ok = cur != l_meta.l || i == last;
+            }
+        }
+    }
+    exception_cancel();
+
+    show_end(0, ok ? "]\n" : " ... ]\n");
+    if (!ok)
+        report_error(0, "ERROR:  Queue is broken before element %lu", last);
+    return ok && !error_check();
+}
+
 static bool do_show(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int first, last;
+
+    if (argc == 1)
+        return show_queue(0);
+
+    if (argc != 3 || !get_int(argv[1], &first) || !get_int(argv[2], &last) ||
+        first < 0 || last < 0) {
+        report(1, "%s takes no arguments, or the first and last element",
+               argv[0]);
         return false;
     }
-    return show_queue(0);
+    return show_range(first, last);
+}
+
+/* Place blocks against guard pages (set through option guard) */
+static int guard_pages = 0;
+
+static void set_guard_pages(int oldval)
+{
+    if (!set_guard_mode(guard_pages)) {
+        report(1, "Cannot change guard mode while blocks are allocated");
+        guard_pages = oldval;
+    }
+}
+
+/* Frames recorded per allocation site (set through option allocprof) */
+static int alloc_profile = 0;
+
+/* Number of allocation sites shown */
+#define ALLOC_SITES_SHOWN 20
+
+static void set_alloc_profile_depth(int oldval)
+{
+    set_alloc_profile(alloc_profile);
+}
+
+/* Sample the program counter while commands run (set through option
+ * profile) */
+static int cpu_profile = 0;
+
+/* Number of functions shown by the sampling profiler */
+#define PROFILE_FUNCS_SHOWN 20
+
+static void set_cpu_profile(int oldval)
+{
+    if (!set_sampling(cpu_profile)) {
+        report(1, "Couldn't start the sampling profiler");
+        cpu_profile = oldval;
+    }
+}
+
+static bool do_allocs(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (!alloc_profile) {
+        report(1, "Allocation profiling is off.  Use 'option allocprof 1'");
+        return false;
+    }
+
+    if (argc == 1) {
+        alloc_profile_report(1, ALLOC_SITES_SHOWN);
+        return true;
+    }
+
+    if (!alloc_profile_dump(argv[1])) {
+        report(1, "Couldn't write allocation sites to '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 1) {
+        fault_show(1);
+        return true;
+    }
+
+    int n = 0;
+    char *op = argc > 3 ? argv[3] : NULL;
+    bool has_value = argc > 2 && get_int(argv[2], &n) && n >= 0;
+
+    if (!strcmp(argv[1], "off") && argc == 2) {
+        fault_schedule(FAULT_OFF, 0, NULL);
+    } else if (!strcmp(argv[1], "seed") && argc == 3 && has_value) {
+        fault_seed((uint64_t) n);
+    } else if (!strcmp(argv[1], "nth") && argc <= 4 && has_value) {
+        fault_schedule(FAULT_NTH, n, op);
+    } else if (!strcmp(argv[1], "every") && argc <= 4 && has_value) {
+        fault_schedule(FAULT_EVERY, n, op);
+    } else if (!strcmp(argv[1], "op") && argc == 3) {
+        fault_schedule(FAULT_OFF, 0, argv[2]);
+    } else {
+        report(1,
+               "%s takes one of: off | seed S | nth N [op] | every K [op] | "
+               "op NAME",
+               argv[0]);
+        return false;
+    }
+
+    fault_show(3);
+    return true;
+}
+
+/* Parse a budget of the form N, len or len+N */
+static bool get_budget(char *spec, int *bytes, bool *per_len)
+{
+    *per_len = !strncmp(spec, "len", 3);
+    if (*per_len) {
+        spec += 3;
+        if (!*spec) {
+            *bytes = 0;
+            return true;
+        }
+        if (*spec++ != '+')
+            return false;
+    }
+    return get_int(spec, bytes) && *bytes >= 0;
+}
+
+static bool do_budget(int argc, char *argv[])
+{
+    int bytes;
+    bool per_len;
+
+    if (argc == 1) {
+        budget_show(1);
+        time_budget_report(1);
+        return true;
+    }
+
+    if (!strcmp(argv[1], "off") && argc == 2) {
+        budget_clear(NULL);
+    } else if (argc == 3 && !strcmp(argv[2], "off")) {
+        budget_clear(argv[1]);
+    } else if (argc == 3 && get_budget(argv[2], &bytes, &per_len)) {
+        if (!budget_set(argv[1], bytes, per_len)) {
+            report(1, "Too many budgets, remove one first");
+            return false;
+        }
+    } else {
+        report(1, "%s takes one of: off | OP off | OP N | OP len[+N]",
+               argv[0]);
+        return false;
+    }
+
+    budget_show(3);
+    return true;
+}
+
+static bool do_gen(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a file name, then settings among:", argv[0]);
+        gen_spec_help(1);
+        return false;
+    }
+
+    gen_spec_t spec;
+    gen_spec_init(&spec);
+    for (int i = 2; i < argc; i++) {
+        if (!gen_spec_parse(&spec, argv[i])) {
+            report(1, "Invalid setting '%s'.  Settings are:", argv[i]);
+            gen_spec_help(1);
+            return false;
+        }
+    }
+    if (!gen_spec_check(&spec))
+        return false;
+
+    if (!gen_trace(&spec, argv[1])) {
+        report(1, "Couldn't write trace to '%s'", argv[1]);
+        return false;
+    }
+    return true;
 }
 
 static void console_init()
@@ -789,18 +1225,56 @@ static void console_init()
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
-    ADD_COMMAND(show, "                | Show queue contents");
+    ADD_COMMAND(show,
+                " [n m]          | Show queue contents, or elements n to m");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
     ADD_COMMAND(
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
+    ADD_COMMAND(allocs,
+                " [file]         | Show top allocation sites, or write them "
+                "to file as collapsed stacks");
+    ADD_COMMAND(fault,
+                " [mode arg]     | Inject malloc failures: off, seed S, "
+                "nth N [op], every K [op] or op NAME (e.g. q_insert_tail)");
+    ADD_COMMAND(budget,
+                " [op bytes]     | Limit bytes allocated per call of op "
+                "(e.g. q_sort 0, q_insert len+64), or off.  Without "
+                "arguments, also show time budget use");
+    ADD_COMMAND(gen,
+                " file [key=val] | Write a generated workload to file, "
+                "e.g. fill=1e3:1e6 ops=1e4 ih=2 rh=1 sort=1 dup=10");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("fastcheck", &fast_check,
+              "Fill only the ends of allocated and freed blocks", NULL);
+    add_param("allocprof", &alloc_profile,
+              "Frames recorded per allocation site (0 = off)",
+              set_alloc_profile_depth);
+    add_param("guard", &guard_pages,
+              "Place blocks against guard pages (only while queue is freed; "
+              "past vm.max_map_count / 2 blocks, check by footer instead)",
+              set_guard_pages);
+    add_param("integrity", &integrity,
+              "List checks after each command: 0 off, 1 ends and samples, "
+              "2 every node",
+              NULL);
+    add_param("profile", &cpu_profile,
+              "Sample where time is spent, shown at quit", set_cpu_profile);
+    add_param("seed", &rand_seed, "Seed for random strings", set_rand_seed);
+    add_param("timelimit", &time_limit,
+              "Time budget of an operation in milliseconds, before scaling "
+              "with queue size (0 = unlimited)",
+              NULL);
+    add_param("qbudget", &queue_budget,
+              "Maximum live bytes of queue memory (0 = unlimited)", NULL);
+    add_param("perf", &perf_counters,
+              "Sample hardware counters in simulation mode", NULL);
 }
 
 /* Signal handlers */
@@ -820,10 +1294,26 @@ static void sigalrmhandler(int sig)
         "code is too inefficient");
 }
 
+static void cmd_hook(size_t index, int argc, char *argv[])
+{
+    set_command_index(index);
+    if (cpu_profile)
+        sampler_drain();
+    event_begin();
+}
+
+static void cmd_done_hook(size_t index, int argc, char *argv[], bool ok)
+{
+    event_end(index, argc, argv, ok);
+}
+
 static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
+    l_meta.size = 0;
+    lcnt = 0;
+    touched_ends = false;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
 }
@@ -834,28 +1324,90 @@ static bool queue_quit(int argc, char *argv[])
     if (lcnt > big_list_size)
         set_cautious_mode(false);
 
+    set_operation("q_free");
+    set_operation_work(l_meta.size);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
     set_cautious_mode(true);
 
+    if (alloc_profile)
+        alloc_profile_report(1, ALLOC_SITES_SHOWN);
+    if (cpu_profile) {
+        set_sampling(false);
+        sampler_report(1, PROFILE_FUNCS_SHOWN);
+    }
+
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
-               bcnt);
+        report_error(1,
+                     "ERROR: Freed queue, but %lu blocks are still allocated",
+                     bcnt);
+        leak_report(1, LEAK_GROUPS_SHOWN);
         return false;
     }
 
     return true;
 }
 
+/*
+ * Bring queue, harness and console back to where they were before the
+ * first trace ran
+ */
+static void reset_state()
+{
+    harness_reset();
+    queue_init();
+    init_cmd();
+    console_init();
+    restore_params();
+    /* Not whatever seeds the previous trace left behind */
+    fault_seed(startup_fault_seed);
+    prng_seed(startup_rand_seed);
+    probe_state = PROBE_SEED;
+    add_quit_helper(queue_quit);
+    sampler_reset();
+}
+
+/*
+ * Run trace files one after another in this process, each as if qtest had
+ * been started afresh on it, and print the outcome of each.  Return true if
+ * all of them pass.
+ */
+static bool run_traces(int count, char *files[])
+{
+    bool all_ok = true;
+
+    save_params();
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            reset_state();
+        /* Like a run of its own, a failed trace doesn't quit */
+        bool ok = run_console(files[i]);
+        ok = ok && finish_cmd();
+        report_flush();
+        printf("%s\t%s\n", ok ? "PASS" : "FAIL", files[i]);
+        fflush(stdout);
+        all_ok = all_ok && ok;
+    }
+    return all_ok;
+}
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-j JFILE] "
+        "[TRACE ...]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write one JSON event per command to JFILE\n");
+    printf("\tTRACE ...  Run each trace file in turn, in this process\n");
+    printf("Environment:\n");
+    printf("\tQTEST_TIMELIMIT  Initial value of option timelimit\n");
+    printf("\tQTEST_SEED       Seed of fault injection and random strings\n");
     exit(0);
 }
 
@@ -904,10 +1456,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char jbuf[BUFSIZE];
+    char *eventfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:j:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -929,9 +1483,14 @@ int main(int argc, char *argv[])
         }
         case 'l':
             strncpy(lbuf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
+            lbuf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            eventfile_name = jbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -939,7 +1498,26 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    char *limit = getenv("QTEST_TIMELIMIT");
+    if (limit && !get_int(limit, &time_limit)) {
+        fprintf(stderr, "Invalid QTEST_TIMELIMIT '%s'\n", limit);
+        exit(EXIT_FAILURE);
+    }
+
+    char *seed = getenv("QTEST_SEED");
+    if (seed) {
+        char *end;
+        startup_fault_seed = startup_rand_seed = strtoull(seed, &end, 0);
+        if (end == seed || *end) {
+            fprintf(stderr, "Invalid QTEST_SEED '%s'\n", seed);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        startup_fault_seed = (uint64_t) time(NULL);
+        randombytes((uint8_t *) &startup_rand_seed, sizeof(startup_rand_seed));
+    }
+    fault_seed(startup_fault_seed);
+    prng_seed(startup_rand_seed);
     queue_init();
     init_cmd();
     console_init();
@@ -955,12 +1533,27 @@ int main(int argc, char *argv[])
     }
     if (logfile_name)
         set_logfile(logfile_name);
+    if (eventfile_name && !event_open(eventfile_name)) {
+        fprintf(stderr, "Couldn't open event file '%s'\n", eventfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(queue_quit);
+    set_cmd_hook(cmd_hook);
+    set_cmd_done_hook(cmd_done_hook);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
-    ok = ok && finish_cmd();
+    if (optind < argc) {
+        if (infile_name) {
+            fprintf(stderr, "Give either -f IFILE or trace files\n");
+            exit(EXIT_FAILURE);
+        }
+        ok = run_traces(argc - optind, argv + optind);
+    } else {
+        ok = ok && run_console(infile_name);
+        ok = ok && finish_cmd();
+    }
+    event_close();
 
     return ok ? 0 : 1;
 }
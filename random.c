@@ -1,11 +1,40 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+/*
+ * Random bytes are produced in user space by ChaCha20, keyed once from the
+ * kernel.  Output is generated a buffer at a time, so randombytes() only
+ * copies from memory on the hot path.  After every refill, the first 32
+ * bytes of fresh output replace the key ("fast key erasure"), so earlier
+ * output cannot be recomputed from the state.
+ *
+ * The generator computes CHACHA_LANES blocks at once: each state word is a
+ * vector holding the same word of several blocks with consecutive counters,
+ * which maps onto SSE/NEON registers.
+ */
+
+#define CHACHA_LANES 4
+#define CHACHA_BLOCK 64
+#define RANDOM_BUFSIZE (64 * CHACHA_BLOCK)
+#define KEY_SIZE 32
+
+typedef uint32_t lanes_t __attribute__((vector_size(4 * CHACHA_LANES)));
+
+static uint32_t key[KEY_SIZE / 4];
+static uint8_t buf[RANDOM_BUFSIZE];
+static size_t buf_pos = RANDOM_BUFSIZE;
+static bool seeded = false;
 
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void read_urandom(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
@@ -37,3 +66,138 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+static void seed(void)
+{
+#if defined(__linux__)
+    if (getrandom(key, sizeof(key), 0) != sizeof(key))
+#endif
+        read_urandom((uint8_t *) key, sizeof(key));
+    seeded = true;
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL(d ^ a, 16);     \
+        c += d;                  \
+        b = ROTL(b ^ c, 12);     \
+        a += b;                  \
+        d = ROTL(d ^ a, 8);      \
+        c += d;                  \
+        b = ROTL(b ^ c, 7);      \
+    } while (0)
+
+/* Produce CHACHA_LANES consecutive blocks starting at block counter ctr */
+static void chacha20_blocks(uint8_t *out, uint32_t ctr)
+{
+    static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32,
+                                      0x6b206574};
+    lanes_t in[16], x[16];
+
+    for (int i = 0; i < 4; i++)
+        in[i] = (lanes_t){0} + sigma[i];
+    for (int i = 0; i < 8; i++)
+        in[4 + i] = (lanes_t){0} + key[i];
+    for (int l = 0; l < CHACHA_LANES; l++)
+        in[12][l] = ctr + l;
+    /* Nonce is zero: the key changes after every refill */
+    for (int i = 13; i < 16; i++)
+        in[i] = (lanes_t){0};
+
+    memcpy(x, in, sizeof(x));
+    for (int r = 0; r < 10; r++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    /* Transpose the lanes back into consecutive 64-byte blocks */
+    for (int i = 0; i < 16; i++) {
+        lanes_t v = x[i] + in[i];
+        for (int l = 0; l < CHACHA_LANES; l++)
+            memcpy(out + l * CHACHA_BLOCK + i * 4, &v[l], 4);
+    }
+}
+
+static void refill(void)
+{
+    if (!seeded)
+        seed();
+
+    for (uint32_t ctr = 0; ctr < RANDOM_BUFSIZE / CHACHA_BLOCK;
+         ctr += CHACHA_LANES)
+        chacha20_blocks(buf + ctr * CHACHA_BLOCK, ctr);
+
+    memcpy(key, buf, KEY_SIZE);
+    memset(buf, 0, KEY_SIZE);
+    buf_pos = KEY_SIZE;
+}
+
+void randombytes(uint8_t *x, size_t how_much)
+{
+    while (how_much > 0) {
+        if (buf_pos == RANDOM_BUFSIZE)
+            refill();
+
+        size_t n = RANDOM_BUFSIZE - buf_pos;
+        if (n > how_much)
+            n = how_much;
+        memcpy(x, buf + buf_pos, n);
+        buf_pos += n;
+        x += n;
+        how_much -= n;
+    }
+}
+
+/* State of prng_next(), seeded by prng_seed() */
+static uint64_t prng_state[4];
+static bool prng_seeded = false;
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Expand the seed with splitmix64, so that nearby seeds give unrelated
+ * streams and the state is never all zero.
+ */
+void prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        prng_state[i] = z ^ (z >> 31);
+    }
+    prng_seeded = true;
+}
+
+uint64_t prng_next(void)
+{
+    if (!prng_seeded) {
+        uint64_t seed;
+        randombytes((uint8_t *) &seed, sizeof(seed));
+        prng_seed(seed);
+    }
+
+    uint64_t *s = prng_state;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+
+    return result;
+}
@@ -6,6 +6,14 @@
 
 void randombytes(uint8_t *x, size_t xlen);
 
+/*
+ * Fast, seedable generator for test data (xoshiro256**).
+ * It is not cryptographic: use randombytes() for anything that must not be
+ * predictable.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
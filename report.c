@@ -1,3 +1,8 @@
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -6,12 +11,14 @@
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "report.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
@@ -24,6 +31,178 @@ static void init_files(FILE *efile, FILE *vfile)
     verbfile = vfile;
 }
 
+/*
+ * Asynchronous output.  Messages are formatted once into a ring per output
+ * file, and a writer thread drains the rings with writev.  The main thread
+ * is the only producer and the writer the only consumer, so the rings need
+ * no lock, and a longjmp out of a report call cannot leave one held.
+ * report_flush() waits until everything queued has been written; it is
+ * called before anything is printed some other way.
+ */
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_WAKE_BYTES (64 * 1024)
+#define LOG_MSG_MAX 4096
+#define LOG_IDLE_NS 100000000
+
+typedef struct {
+    char data[LOG_RING_SIZE];
+    size_t head; /* Advanced by the main thread */
+    size_t tail; /* Advanced by the writer thread */
+    int fd;
+} log_ring_t;
+
+int async_log = 0;
+static bool async_running = false;
+static log_ring_t out_ring, log_ring;
+static pthread_t log_writer;
+static sem_t log_wake;
+static volatile bool log_stop = false;
+
+/* Write out what is queued in ring r, in at most two pieces */
+static void ring_drain(log_ring_t *r)
+{
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t tail = r->tail;
+
+    while (tail != head) {
+        size_t start = tail % LOG_RING_SIZE;
+        size_t first = MIN(head - tail, LOG_RING_SIZE - start);
+        struct iovec iov[2] = {
+            {r->data + start, first},
+            {r->data, head - tail - first},
+        };
+        ssize_t n = writev(r->fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* Output is gone: drop it rather than spin */
+        tail = n < 0 ? head : tail + n;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *log_writer_main(void *arg)
+{
+    while (!log_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_IDLE_NS;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&log_wake, &ts);
+        ring_drain(&out_ring);
+        ring_drain(&log_ring);
+    }
+    return NULL;
+}
+
+static bool ring_empty(log_ring_t *r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head;
+}
+
+static void ring_put(log_ring_t *r, const char *buf, size_t len)
+{
+    size_t head = r->head;
+
+    /* Full: let the writer catch up */
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) + len >
+           LOG_RING_SIZE) {
+        sem_post(&log_wake);
+        sched_yield();
+    }
+
+    size_t start = head % LOG_RING_SIZE;
+    size_t first = MIN(len, LOG_RING_SIZE - start);
+    memcpy(r->data + start, buf, first);
+    memcpy(r->data, buf + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    size_t fill = head + len - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (fill >= LOG_WAKE_BYTES && fill - len < LOG_WAKE_BYTES)
+        sem_post(&log_wake);
+}
+
+void report_flush()
+{
+    if (!async_running)
+        return;
+
+    while (!ring_empty(&out_ring) || !ring_empty(&log_ring)) {
+        sem_post(&log_wake);
+        sched_yield();
+    }
+}
+
+/* Queue a message for the verbose file and the logfile.  Return false when
+ * it does not fit in LOG_MSG_MAX, to be printed synchronously instead.
+ */
+static bool report_async(const char *fmt, va_list ap, bool newline)
+{
+    char msg[LOG_MSG_MAX];
+    int len = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+    if (len < 0 || len >= (int) sizeof(msg) - 1)
+        return false;
+    if (newline)
+        msg[len++] = '\n';
+
+    /* Keep ordering with anything printed through stdio so far */
+    fflush(verbfile);
+    ring_put(&out_ring, msg, len);
+    if (logfile)
+        ring_put(&log_ring, msg, len);
+    return true;
+}
+
+/* Start or stop the writer thread, following option asynclog */
+void set_async_log(bool on)
+{
+    if (on == async_running)
+        return;
+
+    if (!verbfile)
+        init_files(stdout, stdout);
+
+    if (!on) {
+        report_flush();
+        log_stop = true;
+        sem_post(&log_wake);
+        pthread_join(log_writer, NULL);
+        sem_destroy(&log_wake);
+        async_running = false;
+        return;
+    }
+
+    fflush(verbfile);
+    if (logfile)
+        fflush(logfile);
+    out_ring.fd = fileno(verbfile);
+    log_ring.fd = logfile ? fileno(logfile) : -1;
+    log_stop = false;
+    if (sem_init(&log_wake, 0, 0))
+        return;
+    /*
+     * Signals are for the main thread: the sampler's SIGPROF handler is the
+     * only writer of its ring, and SIGALRM jumps back onto the main stack.
+     * The writer inherits a mask blocking all of them.
+     */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&log_writer, NULL, log_writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        sem_destroy(&log_wake);
+        return;
+    }
+
+    static bool flush_at_exit = false;
+    if (!flush_at_exit)
+        flush_at_exit = atexit(report_flush) == 0;
+    async_running = true;
+}
+
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
@@ -44,12 +223,51 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
+/* Close the logfile, after the writer thread is done with it */
+static void close_logfile()
+{
+    report_flush();
+    log_ring.fd = -1;
+    fclose(logfile);
+    logfile = NULL;
+}
+
 bool set_logfile(char *file_name)
 {
+    report_flush();
     logfile = fopen(file_name, "w");
+    log_ring.fd = logfile ? fileno(logfile) : -1;
     return logfile != NULL;
 }
 
+/* Errors reported so far, and the text of the last one */
+static size_t error_count = 0;
+static char last_error[256] = "";
+
+static void record_error_text(char *fmt, va_list ap)
+{
+    vsnprintf(last_error, sizeof(last_error), fmt, ap);
+    error_count++;
+}
+
+void report_record_error(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    record_error_text(fmt, ap);
+    va_end(ap);
+}
+
+size_t report_error_count()
+{
+    return error_count;
+}
+
+const char *report_last_error()
+{
+    return last_error;
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -58,11 +276,19 @@ void report_event(message_t msg, char *fmt, ...)
                      : msg == MSG_ERROR ? "ERROR"
                                         : "FATAL ERROR";
     int level = msg == MSG_WARN ? 2 : msg == MSG_ERROR ? 1 : 0;
+
+    if (msg != MSG_WARN) {
+        va_start(ap, fmt);
+        record_error_text(fmt, ap);
+        va_end(ap);
+    }
     if (verblevel < level)
         return;
 
     if (!errfile)
         init_files(stdout, stdout);
+    /* Errors are rare: print them synchronously, after what came before */
+    report_flush();
 
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
@@ -78,7 +304,7 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "\n");
         fflush(logfile);
         va_end(ap);
-        fclose(logfile);
+        close_logfile();
     }
 
     if (fatal) {
@@ -88,13 +314,22 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-void report(int level, char *fmt, ...)
+void report_print(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
     if (level <= verblevel) {
         va_list ap;
+        if (async_running) {
+            va_start(ap, fmt);
+            bool queued = report_async(fmt, ap, true);
+            va_end(ap);
+            if (queued)
+                return;
+            report_flush();
+        }
+
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
@@ -111,13 +346,22 @@ void report(int level, char *fmt, ...)
     }
 }
 
-void report_noreturn(int level, char *fmt, ...)
+void report_print_noreturn(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
     if (level <= verblevel) {
         va_list ap;
+        if (async_running) {
+            va_start(ap, fmt);
+            bool queued = report_async(fmt, ap, false);
+            va_end(ap);
+            if (queued)
+                return;
+            report_flush();
+        }
+
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fflush(verbfile);
@@ -132,11 +376,44 @@ void report_noreturn(int level, char *fmt, ...)
     }
 }
 
+/* Output len bytes of preformatted text, with a single write to each file */
+void report_write(int level, const char *buf, size_t len)
+{
+    if (!verbfile)
+        init_files(stdout, stdout);
+
+    if (level > verblevel)
+        return;
+
+    fflush(verbfile);
+    if (async_running && len <= LOG_RING_SIZE / 2) {
+        ring_put(&out_ring, buf, len);
+        if (logfile)
+            ring_put(&log_ring, buf, len);
+        return;
+    }
+
+    report_flush();
+    int fd = fileno(verbfile);
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0)
+            break;
+        done += n;
+    }
+
+    if (logfile) {
+        fwrite(buf, 1, len, logfile);
+        fflush(logfile);
+    }
+}
+
 /* Functions denoting failures */
 
 /* Need to be able to print without using malloc */
 static void fail_fun(char *format, char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -152,36 +429,125 @@ static void fail_fun(char *format, char *msg)
         fatal_fun();
 
     if (logfile)
-        fclose(logfile);
+        close_logfile();
 
     exit(1);
 }
 
 /* Maximum number of megabytes that application can use (0 = unlimited) */
-static int mblimit = 0;
-
-/* Keeping track of memory allocation */
-static size_t allocate_cnt = 0;
-static size_t allocate_bytes = 0;
-static size_t free_cnt = 0;
-static size_t free_bytes = 0;
-
-/* Counters giving peak memory usage */
-static size_t peak_bytes = 0;
-static size_t last_peak_bytes = 0;
-static size_t current_bytes = 0;
+int mblimit = 0;
+
+/* Keeping track of memory allocation, per subsystem */
+typedef struct {
+    size_t allocate_cnt;
+    size_t allocate_bytes;
+    size_t free_cnt;
+    size_t free_bytes;
+    /* Counters giving peak memory usage */
+    size_t peak_bytes;
+    size_t current_bytes;
+    /* Bytes held from the allocator, including slack and headers */
+    size_t current_usable;
+    /* Allocation count at last call of mem_report */
+    size_t last_allocate_cnt;
+} mem_stat_t;
+
+static mem_stat_t mem_stats[N_MEM_SUBSYSTEMS];
+static size_t total_bytes = 0;
+static size_t total_peak_bytes = 0;
+static double mem_last_time = 0;
+
+static const char *mem_names[N_MEM_SUBSYSTEMS] = {
+    [MEM_CONSOLE] = "console",
+    [MEM_QUEUE] = "queue",
+    [MEM_DUDECT] = "dudect",
+};
+
+bool mem_exceeds_limit(size_t new_bytes)
+{
+    size_t limit_bytes = (size_t) mblimit << 20;
+    return mblimit > 0 && new_bytes + total_bytes > limit_bytes;
+}
 
 static void check_exceed(size_t new_bytes)
 {
-    size_t limit_bytes = (size_t) mblimit << 20;
-    size_t request_bytes = new_bytes + current_bytes;
-    if (mblimit > 0 && request_bytes > limit_bytes) {
+    if (mem_exceeds_limit(new_bytes)) {
         report_event(MSG_FATAL,
                      "Exceeded memory limit of %u megabytes with %lu bytes",
-                     mblimit, request_bytes);
+                     mblimit, new_bytes + total_bytes);
     }
 }
 
+void mem_alloc_account(mem_subsystem_t sys, size_t bytes, size_t usable)
+{
+    mem_stat_t *m = &mem_stats[sys];
+    /* Rates are measured from the first allocation */
+    if (!mem_last_time)
+        init_time(&mem_last_time);
+    m->allocate_cnt++;
+    m->allocate_bytes += bytes;
+    m->current_bytes += bytes;
+    m->current_usable += usable;
+    m->peak_bytes = MAX(m->peak_bytes, m->current_bytes);
+
+    total_bytes += bytes;
+    total_peak_bytes = MAX(total_peak_bytes, total_bytes);
+}
+
+void mem_free_account(mem_subsystem_t sys, size_t bytes, size_t usable)
+{
+    mem_stat_t *m = &mem_stats[sys];
+    m->free_cnt++;
+    m->free_bytes += bytes;
+    m->current_bytes -= bytes;
+    m->current_usable -= usable;
+
+    total_bytes -= bytes;
+}
+
+size_t mem_current_bytes(mem_subsystem_t sys)
+{
+    return mem_stats[sys].current_bytes;
+}
+
+void mem_counters(mem_subsystem_t sys, mem_counters_t *c)
+{
+    const mem_stat_t *m = &mem_stats[sys];
+    c->allocate_cnt = m->allocate_cnt;
+    c->allocate_bytes = m->allocate_bytes;
+    c->free_cnt = m->free_cnt;
+    c->free_bytes = m->free_bytes;
+    c->current_bytes = m->current_bytes;
+}
+
+void mem_report(int level)
+{
+    double elapsed = delta_time(&mem_last_time);
+    size_t usable = 0;
+
+    report(level, "%-10s %14s %14s %12s %12s %7s", "subsystem", "live bytes",
+           "peak bytes", "allocations", "allocs/sec", "frag%");
+    for (int i = 0; i < N_MEM_SUBSYSTEMS; i++) {
+        mem_stat_t *m = &mem_stats[i];
+        /* Share of memory held beyond what was asked for */
+        double frag = m->current_usable
+                          ? 100.0 * (m->current_usable - m->current_bytes) /
+                                m->current_usable
+                          : 0.0;
+        double rate = (m->allocate_cnt - m->last_allocate_cnt) / elapsed;
+        m->last_allocate_cnt = m->allocate_cnt;
+        usable += m->current_usable;
+
+        report(level, "%-10s %14lu %14lu %12lu %12.0f %7.1f", mem_names[i],
+               m->current_bytes, m->peak_bytes, m->allocate_cnt, rate, frag);
+    }
+    report(level, "%-10s %14lu %14lu %12s %12s %7.1f", "total", total_bytes,
+           total_peak_bytes, "", "",
+           usable ? 100.0 * (usable - total_bytes) / usable : 0.0);
+    if (mblimit > 0)
+        report(level, "Limit: %d megabytes", mblimit);
+}
+
 /* Call malloc & exit if fails */
 void *malloc_or_fail(size_t bytes, char *fun_name)
 {
@@ -192,12 +558,7 @@ void *malloc_or_fail(size_t bytes, char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += bytes;
-    current_bytes += bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    mem_alloc_account(MEM_CONSOLE, bytes, malloc_usable_size(p));
     return p;
 }
 
@@ -211,12 +572,7 @@ void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    mem_alloc_account(MEM_CONSOLE, cnt * bytes, malloc_usable_size(p));
     return p;
 }
 
@@ -231,12 +587,7 @@ char *strsave_or_fail(char *s, char *fun_name)
     if (!ss)
         fail_fun("strsave failed in %s", fun_name);
 
-    allocate_cnt++;
-    allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    mem_alloc_account(MEM_CONSOLE, len + 1, malloc_usable_size(ss));
     return strncpy(ss, s, len + 1);
 }
 
@@ -245,11 +596,10 @@ void free_block(void *b, size_t bytes)
 {
     if (!b)
         report_event(MSG_ERROR, "Attempting to free null block");
+    size_t usable = malloc_usable_size(b);
     free(b);
 
-    free_cnt++;
-    free_bytes += bytes;
-    current_bytes -= bytes;
+    mem_free_account(MEM_CONSOLE, bytes, usable);
 }
 
 /* Free array, as from calloc */
@@ -257,11 +607,10 @@ void free_array(void *b, size_t cnt, size_t bytes)
 {
     if (!b)
         report_event(MSG_ERROR, "Attempting to free null block");
+    size_t usable = malloc_usable_size(b);
     free(b);
 
-    free_cnt++;
-    free_bytes += cnt * bytes;
-    current_bytes -= cnt * bytes;
+    mem_free_account(MEM_CONSOLE, cnt * bytes, usable);
 }
 
 /* Free string saved by strsave_or_fail */
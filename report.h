@@ -3,10 +3,14 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-/* Default reporting level.  Must recompile when change */
+/*
+ * Highest level of report calls compiled in.  Calls above it cost nothing,
+ * whatever the verbosity set at run time.  Must recompile when change
+ */
 #ifndef RPT
-#define RPT 2
+#define RPT 4
 #endif
 
 /* Ways to report interesting behavior and errors */
@@ -25,11 +29,98 @@ void set_verblevel(int level);
 /* Error messages */
 void report_event(message_t msg, char *fmt, ...);
 
-/* Report useful information */
-void report(int verblevel, char *fmt, ...);
+/*
+ * Number of errors reported so far, through report_event or report_error,
+ * and the text of the last one
+ */
+size_t report_error_count();
+const char *report_last_error();
 
-/* Like report, but without return character */
-void report_noreturn(int verblevel, char *fmt, ...);
+/* Report useful information */
+void report_print(int verblevel, char *fmt, ...);
+
+/* Like report_print, but without return character */
+void report_print_noreturn(int verblevel, char *fmt, ...);
+
+/*
+ * The level is checked inline, so that arguments of a message that is not
+ * shown are never evaluated, and no call is made.
+ */
+#define report(level, ...)                                                \
+    do {                                                                  \
+        if (__builtin_expect((level) <= RPT && (level) <= verblevel, 0)) \
+            report_print(level, __VA_ARGS__);                             \
+    } while (0)
+
+#define report_noreturn(level, ...)                                       \
+    do {                                                                  \
+        if (__builtin_expect((level) <= RPT && (level) <= verblevel, 0)) \
+            report_print_noreturn(level, __VA_ARGS__);                    \
+    } while (0)
+
+/* Count an error and keep its text, whatever the verbosity */
+void report_record_error(char *fmt, ...);
+
+/* Report an error found by qtest itself, counted even when not shown */
+#define report_error(level, ...)          \
+    do {                                  \
+        report_record_error(__VA_ARGS__); \
+        report(level, __VA_ARGS__);       \
+    } while (0)
+
+/* Output len bytes of preformatted text, with a single write to each file */
+void report_write(int verblevel, const char *buf, size_t len);
+
+/*
+ * Queue output for a writer thread instead of flushing every message
+ * (set through option asynclog)
+ */
+extern int async_log;
+void set_async_log(bool on);
+
+/* Wait until queued output has been written */
+void report_flush();
+
+/** Memory accounting.  **/
+
+/* Subsystems whose memory is accounted separately */
+typedef enum {
+    MEM_CONSOLE,
+    MEM_QUEUE,
+    MEM_DUDECT,
+    N_MEM_SUBSYSTEMS
+} mem_subsystem_t;
+
+/* Maximum number of megabytes that application can use (0 = unlimited) */
+extern int mblimit;
+
+/* Would allocating new_bytes more exceed mblimit? */
+bool mem_exceeds_limit(size_t new_bytes);
+
+/* Account allocation of bytes, holding usable bytes from the allocator */
+void mem_alloc_account(mem_subsystem_t sys, size_t bytes, size_t usable);
+
+/* Account release of bytes, which held usable bytes from the allocator */
+void mem_free_account(mem_subsystem_t sys, size_t bytes, size_t usable);
+
+/* Bytes currently allocated by subsystem */
+size_t mem_current_bytes(mem_subsystem_t sys);
+
+/* Running totals of a subsystem, for computing deltas */
+typedef struct {
+    size_t allocate_cnt;
+    size_t allocate_bytes;
+    size_t free_cnt;
+    size_t free_bytes;
+    size_t current_bytes;
+} mem_counters_t;
+
+void mem_counters(mem_subsystem_t sys, mem_counters_t *c);
+
+/* Show live and peak bytes, allocation rate since last call and
+ * fragmentation of every subsystem
+ */
+void mem_report(int level);
 
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
@@ -0,0 +1,320 @@
+/* Sampling profiler for qtest */
+
+#define _GNU_SOURCE /* dladdr, REG_RIP */
+#include "sampler.h"
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "report.h"
+
+#define SAMPLE_INTERVAL_US 1000
+
+/* Samples the handler can queue between two drains; a power of two */
+#define SAMPLE_RING 16384
+
+/* Initial size of the table of distinct program counters */
+#define SAMPLE_INIT_SLOTS 1024
+
+/* Most addresses passed to addr2line in one go */
+#define ADDR2LINE_MAX 256
+
+/*
+ * The SIGPROF handler is the only writer of ring_head and the main program
+ * the only writer of ring_tail, so the ring needs no lock.  A full ring
+ * drops samples rather than block inside the handler.
+ */
+static void *ring[SAMPLE_RING];
+static size_t ring_head = 0;
+static size_t ring_tail = 0;
+static size_t dropped = 0;
+
+typedef struct {
+    void *pc; /* NULL for an unused slot */
+    size_t count;
+    char name[128];
+} pc_sample_t;
+
+static pc_sample_t *samples = NULL;
+static size_t sample_slots = 0;
+static size_t sample_used = 0;
+static size_t sample_total = 0;
+
+static bool sampling = false;
+
+static void *context_pc(void *uctx)
+{
+    ucontext_t *uc = uctx;
+#if defined(__x86_64__)
+    return (void *) uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+    return (void *) uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+    return (void *) uc->uc_mcontext.pc;
+#else
+    (void) uc;
+    return NULL;
+#endif
+}
+
+static void sigprof_handler(int sig, siginfo_t *si, void *uctx)
+{
+    size_t head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == SAMPLE_RING) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring[head & (SAMPLE_RING - 1)] = context_pc(uctx);
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static size_t pc_hash(void *pc)
+{
+    return ((uintptr_t) pc * 0x9e3779b97f4a7c15) >> 20;
+}
+
+static pc_sample_t *find_slot(pc_sample_t *table, size_t slots, void *pc)
+{
+    size_t i = pc_hash(pc) & (slots - 1);
+    while (table[i].pc && table[i].pc != pc)
+        i = (i + 1) & (slots - 1);
+    return &table[i];
+}
+
+static bool samples_grow()
+{
+    size_t slots = sample_slots ? 2 * sample_slots : SAMPLE_INIT_SLOTS;
+    pc_sample_t *table = calloc(slots, sizeof(pc_sample_t));
+    if (!table)
+        return false;
+
+    for (size_t i = 0; i < sample_slots; i++) {
+        if (samples[i].pc)
+            *find_slot(table, slots, samples[i].pc) = samples[i];
+    }
+    free(samples);
+    samples = table;
+    sample_slots = slots;
+    return true;
+}
+
+void sampler_drain(void)
+{
+    size_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+    for (; ring_tail != head; ring_tail++) {
+        void *pc = ring[ring_tail & (SAMPLE_RING - 1)];
+        if (!pc)
+            continue;
+        if (4 * (sample_used + 1) > 3 * sample_slots && !samples_grow())
+            break;
+
+        pc_sample_t *s = find_slot(samples, sample_slots, pc);
+        if (!s->pc) {
+            s->pc = pc;
+            sample_used++;
+        }
+        s->count++;
+        sample_total++;
+    }
+    __atomic_store_n(&ring_tail, head, __ATOMIC_RELEASE);
+}
+
+bool set_sampling(bool on)
+{
+    struct itimerval it = {0};
+
+    if (on == sampling)
+        return true;
+
+    if (on) {
+        struct sigaction sa = {0};
+        sa.sa_sigaction = sigprof_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL))
+            return false;
+        it.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+        it.it_value.tv_usec = SAMPLE_INTERVAL_US;
+    }
+    if (setitimer(ITIMER_PROF, &it, NULL))
+        return false;
+    if (!on) {
+        /* A signal already on its way is ignored */
+        signal(SIGPROF, SIG_IGN);
+        sampler_drain();
+    }
+
+    sampling = on;
+    return true;
+}
+
+/* Name the functions of pcs dladdr could not, using addr2line */
+static void addr2line_names(pc_sample_t **pcs, size_t n)
+{
+    char cmd[64 + ADDR2LINE_MAX * 20];
+    Dl_info info, exe;
+    size_t len, count = 0;
+    pc_sample_t *asked[ADDR2LINE_MAX];
+
+    /* Only the executable itself is passed to addr2line */
+    if (!dladdr((void *) sampler_drain, &exe))
+        return;
+    len = snprintf(cmd, sizeof(cmd), "addr2line -f -e /proc/%d/exe",
+                   (int) getpid());
+    for (size_t i = 0; i < n && count < ADDR2LINE_MAX; i++) {
+        if (pcs[i]->name[0] || !dladdr(pcs[i]->pc, &info) ||
+            info.dli_fbase != exe.dli_fbase)
+            continue;
+        /* Offset within the executable, as position independent code */
+        len += snprintf(cmd + len, sizeof(cmd) - len, " 0x%lx",
+                        (unsigned long) ((char *) pcs[i]->pc -
+                                         (char *) info.dli_fbase));
+        asked[count++] = pcs[i];
+    }
+    if (!count)
+        return;
+    strcat(cmd, " 2>/dev/null");
+
+    FILE *f = popen(cmd, "r");
+    if (!f)
+        return;
+
+    char func[sizeof(asked[0]->name)], where[256];
+    for (size_t i = 0; i < count; i++) {
+        if (!fgets(func, sizeof(func), f) || !fgets(where, sizeof(where), f))
+            break;
+        func[strcspn(func, "\n")] = '\0';
+        if (strcmp(func, "??"))
+            snprintf(asked[i]->name, sizeof(asked[i]->name), "%s", func);
+    }
+    pclose(f);
+}
+
+static void sample_name(pc_sample_t *s)
+{
+    Dl_info info;
+
+    if (s->name[0])
+        return;
+    if (!dladdr(s->pc, &info)) {
+        snprintf(s->name, sizeof(s->name), "%p", s->pc);
+    } else if (info.dli_sname) {
+        snprintf(s->name, sizeof(s->name), "%s", info.dli_sname);
+    } else {
+        /* Unresolved: give the object and offset, as harness.c does.  Time
+         * in private functions of libraries is counted per library.
+         */
+        Dl_info exe;
+        const char *obj = strrchr(info.dli_fname, '/');
+        obj = obj ? obj + 1 : info.dli_fname;
+        if (dladdr((void *) sampler_drain, &exe) &&
+            info.dli_fbase != exe.dli_fbase)
+            snprintf(s->name, sizeof(s->name), "[%s]", obj);
+        else
+            snprintf(s->name, sizeof(s->name), "%s+0x%lx", obj,
+                     (unsigned long) ((char *) s->pc -
+                                      (char *) info.dli_fbase));
+    }
+}
+
+typedef struct {
+    const char *name;
+    size_t count;
+} func_sample_t;
+
+static int pc_count_cmp(const void *a, const void *b)
+{
+    const pc_sample_t *x = *(pc_sample_t *const *) a;
+    const pc_sample_t *y = *(pc_sample_t *const *) b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static int func_name_cmp(const void *a, const void *b)
+{
+    return strcmp(((const func_sample_t *) a)->name,
+                  ((const func_sample_t *) b)->name);
+}
+
+static int func_count_cmp(const void *a, const void *b)
+{
+    const func_sample_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+void sampler_report(int level, size_t top)
+{
+    sampler_drain();
+    if (!sample_total) {
+        report(level, "No samples recorded");
+        return;
+    }
+
+    pc_sample_t **pcs = malloc(sample_used * sizeof(pc_sample_t *));
+    func_sample_t *funcs = malloc(sample_used * sizeof(func_sample_t));
+    if (!pcs || !funcs) {
+        free(pcs);
+        free(funcs);
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < sample_slots; i++) {
+        if (samples[i].pc)
+            pcs[n++] = &samples[i];
+    }
+
+    /* Exported symbols first, then addr2line for the hottest of the rest */
+    qsort(pcs, n, sizeof(pc_sample_t *), pc_count_cmp);
+    for (size_t i = 0; i < n; i++) {
+        Dl_info info;
+        if (dladdr(pcs[i]->pc, &info) && info.dli_sname)
+            sample_name(pcs[i]);
+    }
+    addr2line_names(pcs, n);
+
+    /* Fold program counters into the functions holding them */
+    for (size_t i = 0; i < n; i++) {
+        sample_name(pcs[i]);
+        funcs[i] = (func_sample_t){pcs[i]->name, pcs[i]->count};
+    }
+    qsort(funcs, n, sizeof(func_sample_t), func_name_cmp);
+    size_t nfuncs = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (nfuncs && !strcmp(funcs[nfuncs - 1].name, funcs[i].name))
+            funcs[nfuncs - 1].count += funcs[i].count;
+        else
+            funcs[nfuncs++] = funcs[i];
+    }
+    qsort(funcs, nfuncs, sizeof(func_sample_t), func_count_cmp);
+
+    report(level, "%10s %7s  %s", "samples", "share", "function");
+    for (size_t i = 0; i < nfuncs && i < top; i++) {
+        report(level, "%10lu %6.1f%%  %s", funcs[i].count,
+               100.0 * funcs[i].count / sample_total, funcs[i].name);
+    }
+    if (nfuncs > top)
+        report(level, "... %lu more functions", nfuncs - top);
+    if (dropped)
+        report(level, "%lu samples dropped", dropped);
+    free(funcs);
+    free(pcs);
+}
+
+void sampler_reset(void)
+{
+    sampler_drain();
+    free(samples);
+    samples = NULL;
+    sample_slots = 0;
+    sample_used = 0;
+    sample_total = 0;
+    dropped = 0;
+}
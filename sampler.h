@@ -0,0 +1,25 @@
+#ifndef LAB0_SAMPLER_H
+#define LAB0_SAMPLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Sampling profiler.  While running, SIGPROF interrupts the program every
+ * millisecond of CPU time and the interrupted program counter is recorded.
+ * It uses ITIMER_PROF only, leaving SIGALRM to the time limit logic.
+ */
+
+/* Start or stop sampling.  Samples are kept until sampler_reset() */
+bool set_sampling(bool on);
+
+/* Move recorded samples out of the signal handler's ring */
+void sampler_drain(void);
+
+/* Show the top functions by samples taken in them */
+void sampler_report(int level, size_t top);
+
+/* Drop all samples */
+void sampler_reset(void);
+
+#endif /* LAB0_SAMPLER_H */
@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+
+# Check that a trace run after another one in a single qtest process gives
+# the same output as when run on its own.  Startup seeds are fixed with
+# QTEST_SEED, so that both runs start from the same state.
+
+QTEST=${QTEST:-./qtest}
+FIRST=traces/multi-seed.cmd
+SECOND=traces/multi-fresh.cmd
+export QTEST_SEED=${QTEST_SEED:-1}
+
+alone=$($QTEST -v 3 -f $SECOND)
+# Output of the second trace: after the verdict on the first, up to its own
+shared=$($QTEST -v 3 $FIRST $SECOND |
+    awk -v first="$FIRST" -v second="$SECOND" '
+        $0 ~ "^(PASS|FAIL)\t" second "$" { on = 0 }
+        on { print }
+        $0 ~ "^(PASS|FAIL)\t" first "$" { on = 1 }')
+
+if [ "$alone" != "$shared" ]; then
+    echo "FAIL: $SECOND gives different output after $FIRST"
+    diff <(echo "$alone") <(echo "$shared")
+    exit 1
+fi
+echo "PASS: $SECOND gives the same output after $FIRST"
@@ -1,9 +1,13 @@
 #!/usr/bin/env python3
 
 from __future__ import print_function
+import os
 import subprocess
 import sys
 import getopt
+import json
+import math
+import time
 
 
 
@@ -17,6 +21,25 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 1
+
+    # Timing-sensitive trace, run alone on a core of its own with -j
+    complexityTrace = 17
+
+    # Traces timed by --bench unless one is picked with -t
+    benchTraces = [14, 15, 16]
+
+    # Quantities measured per run, as (key, description, unit)
+    benchMetrics = [("wall", "wall time", "s"),
+                    ("user", "user time", "s"),
+                    ("sys", "system time", "s"),
+                    ("maxrss", "max RSS", "KiB")]
+
+    # Two-sided 95% critical values of Student's t, by degrees of freedom
+    tTable = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+              2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+              2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+              2.060, 2.056, 2.052, 2.048, 2.045, 2.042]
 
     traceDict = {
         1: "trace-01-ops",
@@ -69,26 +92,31 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 jobs=1):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.jobs = jobs
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
+    def traceCommand(self, tid):
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        vname = "%d" % self.verbLevel
+        return self.command + ["-v", vname, "-f", fname]
+
     def runTrace(self, tid):
         if not tid in self.traceDict:
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
             return False
-        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
-        vname = "%d" % self.verbLevel
-        clist = self.command + ["-v", vname, "-f", fname]
+        clist = self.traceCommand(tid)
 
         try:
             retcode = subprocess.call(clist)
@@ -97,6 +125,190 @@ class Tracer:
             return False
         return retcode == 0
 
+    # Run a trace with its output captured, optionally pinned to some cores.
+    # Returns (ok, output, error message)
+    def runCaptured(self, tid, cpus=None):
+        clist = self.traceCommand(tid)
+        try:
+            p = subprocess.Popen(clist, stdout=subprocess.PIPE,
+                                 stderr=subprocess.STDOUT)
+            # preexec_fn is unsafe with threads, so pin right after starting
+            if cpus and hasattr(os, "sched_setaffinity"):
+                try:
+                    os.sched_setaffinity(p.pid, cpus)
+                except OSError:
+                    pass
+            output = p.communicate()[0]
+        except Exception as e:
+            return (False, b"", "Call of '%s' failed: %s" % (" ".join(clist), e))
+        return (p.returncode == 0, output, None)
+
+    # Start every trace in tidList, at most self.jobs at a time.  The
+    # complexity trace gets a core to itself, which the others stay off.
+    # Yields (tid, ok, output, error) in trace ID order.
+    def runParallel(self, tidList):
+        from concurrent.futures import ThreadPoolExecutor
+
+        cores = sorted(os.sched_getaffinity(0)) \
+            if hasattr(os, "sched_getaffinity") else []
+        alone = None
+        others = None
+        if self.complexityTrace in tidList and len(cores) > 1:
+            alone = set([cores[-1]])
+            others = set(cores[:-1])
+
+        pool = ThreadPoolExecutor(max_workers=self.jobs)
+        solo = ThreadPoolExecutor(max_workers=1)
+        futures = {}
+        for t in tidList:
+            if t == self.complexityTrace and alone:
+                futures[t] = solo.submit(self.runCaptured, t, alone)
+            elif t != self.complexityTrace:
+                futures[t] = pool.submit(self.runCaptured, t, others)
+        if self.complexityTrace in tidList and not alone:
+            # No spare core: run it once everything else is done
+            pool.shutdown(wait=True)
+            futures[self.complexityTrace] = solo.submit(self.runCaptured,
+                                                        self.complexityTrace)
+        for t in tidList:
+            ok, output, error = futures[t].result()
+            yield (t, ok, output, error)
+        pool.shutdown()
+        solo.shutdown()
+
+    def runAll(self, tidList):
+        if self.jobs <= 1 or len(tidList) <= 1:
+            for t in tidList:
+                if self.verbLevel > 0:
+                    print("+++ TESTING trace %s:" % self.traceDict[t])
+                yield (t, self.runTrace(t))
+            return
+        for (t, ok, output, error) in self.runParallel(tidList):
+            if self.verbLevel > 0:
+                print("+++ TESTING trace %s:" % self.traceDict[t])
+            sys.stdout.flush()
+            if hasattr(sys.stdout, "buffer"):
+                sys.stdout.buffer.write(output)
+                sys.stdout.buffer.flush()
+            else:
+                sys.stdout.write(output)
+            if error:
+                self.printInColor(error, self.RED)
+            yield (t, ok)
+
+    # Run a trace once with output discarded.  Returns (ok, measurements)
+    def runMeasured(self, tid):
+        clist = self.traceCommand(tid)
+        devnull = open(os.devnull, "w")
+        try:
+            start = time.time()
+            p = subprocess.Popen(clist, stdout=devnull, stderr=devnull)
+            pid, status, ru = os.wait4(p.pid, 0)
+            wall = time.time() - start
+            p.returncode = status  # Reaped here, not by Popen
+        finally:
+            devnull.close()
+        return (status == 0, {"wall": wall,
+                              "user": ru.ru_utime,
+                              "sys": ru.ru_stime,
+                              "maxrss": float(ru.ru_maxrss)})
+
+    def tCritical(self, df):
+        df = int(math.floor(df))
+        if df < 1:
+            return float("inf")
+        if df <= len(self.tTable):
+            return self.tTable[df - 1]
+        return 1.960
+
+    # Mean, median, sample standard deviation and 95% confidence half-width
+    def stats(self, xs):
+        n = len(xs)
+        mean = sum(xs) / n
+        ys = sorted(xs)
+        median = ys[n // 2] if n % 2 else (ys[n // 2 - 1] + ys[n // 2]) / 2
+        sd = math.sqrt(sum((x - mean) ** 2 for x in xs) / (n - 1)) \
+            if n > 1 else 0.0
+        ci = self.tCritical(n - 1) * sd / math.sqrt(n) if n > 1 else 0.0
+        return {"n": n, "mean": mean, "median": median, "sd": sd, "ci": ci}
+
+    # Welch's t-test: True if the mean of new is larger than that of old
+    # at the 95% level
+    def slower(self, old, new):
+        a = self.stats(old)
+        b = self.stats(new)
+        if a["n"] < 2 or b["n"] < 2 or b["mean"] <= a["mean"]:
+            return False
+        va = a["sd"] ** 2 / a["n"]
+        vb = b["sd"] ** 2 / b["n"]
+        if va + vb == 0:
+            return True
+        t = (b["mean"] - a["mean"]) / math.sqrt(va + vb)
+        df = (va + vb) ** 2 / (va ** 2 / (a["n"] - 1) + vb ** 2 / (b["n"] - 1))
+        return t > self.tCritical(df)
+
+    # Time each trace in tidList over reps runs, compare against the runs
+    # saved in baseline and write these runs to save.  Returns True unless
+    # a trace failed or got significantly slower.
+    def bench(self, tidList, reps, baseline="", save=""):
+        if not hasattr(os, "wait4"):
+            self.printInColor("ERROR: --bench needs os.wait4", self.RED)
+            return False
+        self.command = [self.qtest]
+        old = {}
+        if baseline != "":
+            try:
+                with open(baseline) as f:
+                    old = json.load(f)["traces"]
+            except (IOError, OSError, ValueError, KeyError) as e:
+                self.printInColor("ERROR: Cannot read baseline '%s': %s" %
+                                  (baseline, e), self.RED)
+                return False
+
+        good = True
+        results = {}
+        for t in tidList:
+            tname = self.traceDict[t]
+            runs = {key: [] for (key, desc, unit) in self.benchMetrics}
+            for r in range(reps):
+                ok, m = self.runMeasured(t)
+                if not ok:
+                    self.printInColor("---\t%s\tfailed on run %d" %
+                                      (tname, r + 1), self.RED)
+                    good = False
+                    break
+                for key in runs:
+                    runs[key].append(m[key])
+            if len(runs["wall"]) < reps:
+                continue
+            results[tname] = runs
+
+            print("---\t%s\t%d runs" % (tname, reps))
+            print("\t%-12s %10s %10s %10s %10s" %
+                  ("", "mean", "median", "stddev", "95% CI"))
+            for (key, desc, unit) in self.benchMetrics:
+                st = self.stats(runs[key])
+                line = "\t%-12s %10.4g %10.4g %10.4g %10.3g %s" % \
+                    (desc, st["mean"], st["median"], st["sd"], st["ci"], unit)
+                if tname not in old or key not in old[tname]:
+                    print(line)
+                    continue
+                base = self.stats(old[tname][key])
+                change = 100.0 * (st["mean"] - base["mean"]) / base["mean"] \
+                    if base["mean"] else 0.0
+                line += "  %+6.1f%%" % change
+                if self.slower(old[tname][key], runs[key]):
+                    self.printInColor(line + "  REGRESSION", self.RED)
+                    good = False
+                else:
+                    print(line)
+
+        if save != "":
+            with open(save, "w") as f:
+                json.dump({"reps": reps, "traces": results}, f, indent=1)
+                f.write("\n")
+        return good
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
@@ -113,11 +325,8 @@ class Tracer:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
-        for t in tidList:
+        for (t, ok) in self.runAll(list(tidList)):
             tname = self.traceDict[t]
-            if self.verbLevel > 0:
-                print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
             if tval < maxval:
@@ -146,12 +355,18 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [-j N] [--valgrind] [-c]" % name)
+    print("       %s --bench [-p PROG] [-t TID] [-r R] [--baseline FILE] [--save FILE]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
+    print("  -j N      Run up to N traces at once")
     print("  -c Enable colored text")
+    print("  --bench   Time performance traces instead of scoring them")
+    print("  -r R      Runs per trace with --bench (default 10)")
+    print("  --baseline FILE  Flag significant slowdowns against FILE")
+    print("  --save FILE      Save the runs to FILE as a new baseline")
     sys.exit(0)
 
 
@@ -163,8 +378,14 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 1
+    bench = False
+    reps = 10
+    baseline = ""
+    save = ""
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cj:r:',
+                                  ['valgrind', 'bench', 'baseline=', 'save='])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +402,16 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-j':
+            jobs = int(val)
+        elif opt == '--bench':
+            bench = True
+        elif opt == '-r':
+            reps = int(val)
+        elif opt == '--baseline':
+            baseline = val
+        elif opt == '--save':
+            save = val
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +421,19 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               jobs=jobs)
+    if bench:
+        if tid != 0 and not tid in t.traceDict:
+            t.printInColor("ERROR: Invalid trace ID %d" % tid, t.RED)
+            sys.exit(1)
+        if reps < 1:
+            t.printInColor("ERROR: Need at least one run", t.RED)
+            sys.exit(1)
+        tidList = [tid] if tid != 0 else t.benchTraces
+        if not t.bench(tidList, reps, baseline, save):
+            sys.exit(1)
+        return
     t.run(tid)
 
 
@@ -0,0 +1,13 @@
+# Output depends only on the startup seeds and default options, so it is the
+# same whether this trace runs alone or after traces/multi-seed.cmd
+option
+fault
+option fail 30
+new
+option malloc 10
+ih RAND 5
+it RAND 5
+show
+fault
+option malloc 0
+free
@@ -0,0 +1,10 @@
+# Change seeds and options, none of which may reach the traces after this
+# one in a multi-trace run (see scripts/check-multi-trace.sh)
+option seed 5
+option fail 30
+option malloc 10
+fault seed 7
+fault every 3
+new
+ih RAND 10
+free